@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <sys/stat.h>
@@ -11,260 +12,1010 @@
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <dirent.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #include "threadpool.h"
 
 #define LEN 512
 #define BUF_LEN 1024
+#define MAX_EVENTS 64
+#define MAX_LOOPS 64
+#define QUEUE_LIMIT 256 /// requests waiting for a thread, more are answered with 503
+#define QUEUE_HIGH_WATERMARK 192 /// stop accepting at this queue depth
+#define QUEUE_LOW_WATERMARK 64 /// accept again once the queue drained to here
+#define ACCEPT_RETRY_MS 10
+#ifndef LISTEN_BACKLOG
+#define LISTEN_BACKLOG 1024 /// pending connections of every listener, the kernel caps it at somaxconn
+#endif
+#ifndef LISTEN_DEFER_ACCEPT
+#define LISTEN_DEFER_ACCEPT 1 /// seconds a connection waits in the kernel for its request, 0 - off
+#endif
+#ifndef LISTEN_FASTOPEN
+#define LISTEN_FASTOPEN 256 /// TCP Fast Open requests waiting for accept, 0 - off
+#endif
+#define MAX_CONNECTIONS 4096 /// connection contexts, reused after every connection
+#define ARENA_BLOCK 8192 /// first block of every connection arena, kept between requests
+#define PIPE_BUF_LEN 65536 /// bytes moved by one splice
+#define RELAY_BUF_LEN (16 * 1024) /// bytes of a body read to user space at once, a buffer of every connection that needs one
+#define MAX_HEAD_LEN 65536 /// longest response head accepted from a server
+#define MAX_REQUEST_HEAD 16384 /// longest request head accepted from a client
+#define MAX_REQUEST_HEADERS 64
+#define REQUEST_READ_LEN 4096 /// bytes asked from the client socket by one read
+#define UPSTREAM_BUCKETS 256 /// hash buckets of the origins
+#define UPSTREAM_MAX_IDLE 8 /// idle connections kept per origin
+#define UPSTREAM_IDLE_TIMEOUT 30 /// seconds an idle connection is kept
+#define FLIGHT_BUCKETS 256 /// hash buckets of the fetches in progress
+#define HOT_SHARDS 16 /// locks of the in-memory cache
+#define HOT_BUCKETS 1024 /// hash buckets in every shard
+#define HOT_CACHE_BUDGET (64 * 1024 * 1024) /// bytes of objects kept in memory
+#define HOT_OBJECT_MAX (256 * 1024) /// bigger files are always sent from disk
+#define CLIENT_IDLE_TIMEOUT 15 /// seconds a client connection may wait for its next request
+#define DNS_BUCKETS 1024
+#define HOST_BUCKETS 1024 /// first size of the host filter tables, they double as they fill
+#define HOST_NAME_MAX_LEN 255 /// longer names can't be in the host filter
+#define FILTER_DRAIN_US 1000 /// how often the reload waits for readers of the old filter
+#define DECISION_SHARDS 16 /// locks of the decision cache
+#define DECISION_BUCKETS 1024 /// hash buckets in every shard
+#define DECISION_SHARD_MAX 4096 /// hosts remembered by every shard, the oldest goes first
+#define DECISION_TTL 30 /// seconds a host is known as allowed or blocked
+#define DNS_CACHE_MAX 4096 /// names kept by the resolver
+#define DNS_TTL 60 /// seconds an address is used before it is resolved again
+#define DNS_NEGATIVE_TTL 10 /// seconds a name that doesn't exist is remembered
+#define DNS_TIMEOUT 5 /// seconds a lookup may take, then it fails and is not remembered
+#define CACHE_DIR "cache" /// root of the cache store, two levels of directories by the hash of the key
+#define CACHE_KEY_QUERY 1 /// 0 - the query string is not part of the cache key
+#define STORE_SHARDS 16 /// locks of the index of the cache store
+#define STORE_BUCKETS 4096 /// hash buckets in every shard
+#define CACHE_MAX_BYTES (1024L * 1024 * 1024) /// disk budget of the cache store
+#define CACHE_MAX_INODES 200000 /// files of the cache store, every object has two
+#define CACHE_LOW_PERCENT 90 /// the evictor stops once the store is under this part of the budget
+#define CACHE_OBJECT_MAX (64L * 1024 * 1024) /// bigger responses are only relayed
+#define CACHE_ADMIT_MIN 2 /// requests of a URL, as counted by the sketch, before its response is stored
+#define SKETCH_DEPTH 4 /// rows of the frequency sketch
+#define SKETCH_WIDTH 65536 /// counters in every row
+#define SKETCH_COUNTER_MAX 15
+#define SKETCH_AGING (10L * SKETCH_WIDTH) /// requests counted before all the counters are halved
+#define WRITER_PIPE_SIZE (1024 * 1024) /// bytes of a fill waiting for the cache writer, more drop the fill
+#define URING_ENTRIES 16 /// submission queue of the ring of every thread
+#define EVICT_INTERVAL 5 /// seconds between checks of the budget, a fill over it wakes the evictor at once
+#define CACHE_DEFAULT_TTL 60 /// seconds a cached response without any freshness information is fresh
+#define CACHE_HEURISTIC_MAX 86400 /// longest lifetime guessed from Last-Modified
+#define META_VALUE_LEN 128 /// longest validator or Content-Type kept in the metadata of a cached file
+#define META_MAGIC 0x4d455442 /// changes with the layout of CacheMeta, older metadata is not read
+#define META_SUFFIX ".meta"
 
-typedef struct NodeHost {
-    char *data;
-    struct NodeHost *next;
-} NodeHost;
-
-typedef struct LinkList_Host {
-    NodeHost *first;
-    NodeHost *last;
-    int size;
-} LinkList_Host;
-
-typedef struct NodeIP {
-    char *data;
-    int mask;
-    struct NodeIP *next;
-} NodeIP;
-
-typedef struct LinkList_IP {
-    NodeIP *first;
-    NodeIP *last;
-    int size;
-} LinkList_IP;
+typedef struct HostName {
+    char *name; /// lower case
+    unsigned long hash;
+    struct HostName *next;
+} HostName;
+
+typedef struct HostLabel { /// an edge of the suffix trie, one more label to the left of parent
+    int parent, node, wildcard; /// wildcard - "*." rule, every name under node is blocked
+    unsigned long hash;
+    char *label;
+    size_t len;
+    struct HostLabel *next;
+} HostLabel;
+
+typedef struct HostFilter {
+    HostName **names; /// exact rules
+    HostLabel **labels; /// the suffix trie of the wildcard rules, nodes are numbered from the root 0
+    int nameBuckets, labelBuckets, size, labelCount, nodes;
+} HostFilter;
+
+typedef struct IpRange {
+    uint32_t first, last; /// host byte order, inclusive
+} IpRange;
+
+typedef struct IpFilter {
+    IpRange *ranges; /// sorted and merged by compileIpFilter
+    int size, capacity;
+} IpFilter;
+
+typedef struct Filter { /// a snapshot of the filter file, never changed after it is loaded
+    int unFilter; /// 1 - the file is empty
+    unsigned long generation; /// counts the reloads
+    HostFilter *host;
+    IpFilter *ip;
+} Filter;
 
 typedef struct URL {
-    char *hostName, *path, *fullPath;
+    char *hostName, *path, *fullPath; /// fullPath - the file of the object in the cache store
+    char *authority; /// hostName, with ":port" when the port isn't 80
+    int port; /// of the server
+    char *key; /// the canonical URL, equal URLs share the cached object
+    unsigned long keyHash;
+    struct in_addr addr; /// the address of hostName, resolved once for the request
 } URL;
 
+#define REQ_LINE 0
+#define REQ_HEADERS 1
+#define REQ_DONE 2
+#define REQ_ERROR 3
+
+typedef struct Span { /// a part of the request buffer, by offset so it survives a realloc
+    uint32_t off, len;
+} Span;
+
+typedef struct RequestParser {
+    int state;
+    size_t scanned; /// bytes of the buffer already looked at
+    size_t lineStart;
+    size_t headLen; /// length of the head with its empty line, once REQ_DONE
+    Span method, path, version;
+    int headerCount;
+    Span names[MAX_REQUEST_HEADERS], values[MAX_REQUEST_HEADERS];
+} RequestParser;
+
+typedef struct ResponseHead { /// parsed in one pass as the head arrives, same states as the request parser
+    int state;
+    size_t scanned, lineStart, headLen;
+    int status, minor; /// HTTP/1.minor
+    ssize_t contentLength; /// -1 - none
+    int chunked, otherCoding, encoded; /// encoded - has a Content-Encoding
+    int close, keepAlive; /// from the Connection header
+    int noStore, noCache, isPrivate;
+    int contentRange; /// a part of the object, never cached
+    long maxAge; /// max-age or s-maxage, -1 - none
+    Span date, lastModified, etag, expires, contentType;
+} ResponseHead;
+
+typedef struct CacheMeta { /// kept in a hidden file next to the cached file
+    unsigned int magic;
+    int status, noCache;
+    unsigned int keyLen; /// the key follows the struct in the file
+    long maxAge; /// -1 - none
+    time_t stored, date; /// when the response was stored or revalidated, its Date
+    time_t expires, lastModifiedAt; /// -1 - none
+    char etag[META_VALUE_LEN], lastModified[META_VALUE_LEN]; /// validators as the server sent them, "" - none
+    char contentType[META_VALUE_LEN]; /// as the server sent it, "" - guessed from the path
+} CacheMeta;
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size, used;
+    char data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *first, *current;
+    char *last; /// the last allocation, can grow in place
+} Arena;
+
+typedef struct HotObject {
+    char *key;
+    unsigned long hash;
+    char *data; /// the response header (without Connection) followed by the body
+    size_t len, headerLen;
+    int refs, dead; /// senders using it, evicted while in use
+    time_t freshUntil; /// 0 - always fresh
+    struct HotObject *hnext; /// hash chain
+    struct HotObject *prev, *next; /// LRU list, most recent first
+} HotObject;
+
+typedef struct HotShard {
+    pthread_mutex_t lock;
+    HotObject *buckets[HOT_BUCKETS];
+    HotObject *head, *tail;
+    size_t bytes;
+} HotShard;
+
+typedef struct StoreEntry { /// a file of the cache store
+    char *key;
+    unsigned long hash; /// also names the file
+    off_t size;
+    unsigned long lastUse; /// the store clock at the last hit
+    struct StoreEntry *hnext;
+    struct StoreEntry *prev, *next; /// LRU list of the shard, most recent first
+} StoreEntry;
+
+typedef struct StoreShard {
+    pthread_mutex_t lock;
+    StoreEntry *buckets[STORE_BUCKETS];
+    StoreEntry *head, *tail;
+} StoreShard;
+
+typedef struct CacheStore {
+    StoreShard shards[STORE_SHARDS];
+    unsigned char made[256 * 256 / 8]; /// the directories known to exist, set atomically
+    long bytes, inodes; /// of all the objects, updated atomically
+    unsigned long clock; /// counts the hits, orders the shards for the evictor
+    unsigned char sketch[SKETCH_DEPTH][SKETCH_WIDTH]; /// count-min sketch of the requests of every key
+    long sketchAdds; /// requests counted since the last aging
+    pthread_mutex_t evictLock;
+    pthread_cond_t evictWake;
+    int stopping; /// under evictLock, 1 - the evictor ends
+    pthread_t evictThread;
+    int evicting; /// 1 - the evictor runs
+} CacheStore;
+
+typedef struct HotCache {
+    HotShard shards[HOT_SHARDS];
+} HotCache;
+
+#define CHUNK_SIZE 0
+#define CHUNK_SIZE_LINE 1
+#define CHUNK_DATA 2
+#define CHUNK_DATA_END 3
+#define CHUNK_TRAILER 4
+#define CHUNK_TRAILER_LINE 5
+#define CHUNK_DONE 6
+
+typedef struct ChunkState {
+    int state, digits;
+    size_t left; /// size of the chunk, then what is left of its data
+} ChunkState;
+
+#define DNS_PENDING 0
+#define DNS_FOUND 1
+#define DNS_MISSING 2
+#define DNS_FAILED 3 /// the last lookup failed, the next request resolves it again
+
+typedef struct DnsEntry {
+    char *name;
+    unsigned long hash;
+    int state, refreshing; /// refreshing - one thread resolves an expired name, the others use the old address
+    int waiters; /// threads waiting for the pending lookup, the entry stays while there are any
+    struct in_addr addr;
+    time_t expires;
+    struct DnsEntry *next;
+} DnsEntry;
+
+typedef struct DnsQuery { /// a getaddrinfo_a lookup, its memory is used until it ends
+    struct gaicb request;
+    struct addrinfo hints;
+    char *name;
+    struct DnsQuery *next;
+} DnsQuery;
+
+typedef struct Resolver {
+    pthread_mutex_t lock;
+    pthread_cond_t resolved; /// signalled when a pending name is resolved
+    int count;
+    DnsEntry *buckets[DNS_BUCKETS];
+    DnsQuery *abandoned; /// lookups given up after DNS_TIMEOUT, freed once they end
+} Resolver;
+
+#define FLIGHT_PENDING 0 /// the head of the response didn't arrive yet
+#define FLIGHT_STREAMING 1 /// the body is written to the temporary file
+#define FLIGHT_DONE 2 /// the file is in the cache
+#define FLIGHT_FAILED 3 /// the fetch failed or its response is not cached
+
+#define DECISION_ALLOWED 0
+#define DECISION_BLOCKED 1
+#define DECISION_MISSING 2
+
+typedef struct Decision { /// what the filter and the resolver said about a host
+    char *host;
+    unsigned long hash, generation; /// generation - of the filter that made it
+    int verdict;
+    struct in_addr addr; /// for DECISION_ALLOWED
+    time_t expires;
+    struct Decision *hnext, *older, *newer;
+} Decision;
+
+typedef struct DecisionShard {
+    pthread_mutex_t lock;
+    Decision *buckets[DECISION_BUCKETS];
+    Decision *oldest, *newest;
+    int count;
+} DecisionShard;
+
+typedef struct DecisionCache {
+    DecisionShard shards[DECISION_SHARDS];
+} DecisionCache;
+
+typedef struct Origin {
+    char *hostName; /// with ":port" when the port isn't 80
+    int count; /// idle connections, the last one is the most recently used
+    int fds[UPSTREAM_MAX_IDLE];
+    time_t since[UPSTREAM_MAX_IDLE];
+    struct Origin *next;
+} Origin;
+
+typedef struct UpstreamPool {
+    pthread_mutex_t lock;
+    Origin *buckets[UPSTREAM_BUCKETS];
+} UpstreamPool;
+
+struct FlightTable;
+
+typedef struct Flight { /// a fetch of a cache miss, the other requests of the same file wait for it
+    char *key;
+    unsigned long hash;
+    int state;
+    char *tempPath; /// the file being filled, once FLIGHT_STREAMING
+    ssize_t length, written; /// of the body, and how much of it is in the file
+    char contentType[META_VALUE_LEN]; /// of the response, for the waiters that send the file as it grows
+    int refs; /// the one that fetches and the waiters
+    struct argThread *waiters; /// connections parked until written or the state changes, handed back to their loops
+    struct FlightTable *table;
+    struct Flight *next;
+} Flight;
+
+typedef struct FlightTable {
+    pthread_mutex_t lock; /// of the table and all the flights
+    Flight *buckets[FLIGHT_BUCKETS];
+} FlightTable;
+
+typedef struct Fill { /// a response written to the cache store by the writer thread
+    int pipeFd; /// read end, the relay tees the body into the other end
+    int fileFd; /// the temporary file
+    char *tempPath, *fullPath, *key;
+    unsigned long hash;
+    CacheMeta meta;
+    off_t written;
+    int dropped; /// set by the relay before it closes its end
+    int replaces; /// set by the relay: dropped, it removes the stale file it was to replace
+    Flight *flight; /// with a reference of its own, NULL - not shared
+    struct Fill *next; /// in the queue of the fills to publish
+} Fill;
+
+typedef struct CacheWriter {
+    int epfd, stopFd;
+    int active; /// fills not finished yet, updated atomically
+    CacheStore *store;
+    Arena arena; /// for the paths of the metadata, used by the publisher
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneWake;
+    Fill *done; /// drained fills waiting for the publisher, under doneLock
+    int stopping; /// under doneLock
+    pthread_t thread, publisher;
+} CacheWriter;
+
+#define CONN_READING 0 /// the loop reads the request
+#define CONN_PREPARING 1 /// a pool thread parses the request and looks in the cache
+#define CONN_SENDING 2 /// the loop sends a response from memory or a cached file
+#define CONN_CONNECTING 3 /// the loop connects to the server
+#define CONN_EXCHANGE 4 /// the loop sends the request to the server and reads the response head
+#define CONN_STORING 5 /// a pool thread starts the fill, or stores the metadata of a 304
+#define CONN_RELAY 6 /// the loop relays the body from the server
+#define CONN_FOLLOWING 7 /// the loop sends the file that another request fetches
+#define CONN_CLOSED 8 /// freed once the loop handled its events
+
+typedef struct Relay { /// the response to a request, a pool thread plans it and the event loop sends it
+    URL *url;
+    char *req; /// the request for the server
+    int keepAlive;
+    char *rest; /// pipelined bytes after the request, malloc'ed
+    size_t restLen;
+    const char *source; /// for the log
+    size_t sent; /// bytes sent to the client
+    struct iovec iov[3]; /// the head (and a body from memory) not sent yet
+    int iovCount, headSent;
+    HotObject *obj; /// sent from memory, with a reference
+    int fileFd; /// sent by sendfile, -1 - none
+    off_t offset, fileLen;
+    int blocked; /// following: 1 - waits for the client to take more, 0 - for the flight
+    Flight *flight; /// this request fetches for the others, NULL - not shared
+    Flight *follow; /// another request fetches for this one
+    CacheMeta *stale; /// the metadata of the stale cached file the request revalidates, NULL - none
+    int staleFd;
+    int upSd, reused, upWatched; /// the server connection, reused - it came from the idle pool
+    size_t reqSent;
+    char *head; /// the response head and the start of the body
+    ssize_t headTotal, headCap, headCount;
+    ResponseHead res;
+    ssize_t bodyLen, remaining, sizeOfFile; /// remaining - of the body to read, -1 - until it ends
+    int reuse, chunked, cache, removeStale;
+    ChunkState chunks;
+    Fill *fill;
+    int fillFd, out; /// the pipe of the cache writer, out - -1 once the fill is dropped
+    int usePipe; /// 1 - the body is spliced through the pipe of the connection
+    ssize_t pipeBytes; /// in that pipe, not sent yet
+    size_t bufStart, bufEnd; /// the part of the buffer of the connection not sent yet
+} Relay;
+
+struct serverCtx;
+
 typedef struct argThread {
-    int sd, unFilter;
-    LinkList_Host *host_list;
-    LinkList_IP *ip_list;
+    int sd;
+    int phase; /// CONN_*, the pool thread or the loop that has the connection goes on from it
+    int watched; /// 1 - the client socket is in the epoll of the loop
+    Arena arena; /// everything allocated for the request, reset when it ends
+    char *req; /// the request as read so far by the event loop
+    ssize_t totalLenReq;
+    RequestParser parser; /// how far req was parsed
+    time_t lastActive;
+    struct argThread *idlePrev, *idleNext; /// idle list of the loop, or its inbox
+    struct argThread *waitNext; /// the waiters of a flight
+    struct argThread *deferNext; /// handed to the pool or freed once the loop handled its events
+    Relay relay; /// the response being sent
+    char *buf; /// RELAY_BUF_LEN bytes for bodies that go through user space, made at the first use
+    int pipe[2]; /// bodies are spliced through it, made at the first use, -1 - none
+    int counted; /// 1 - the request is in countReq and not in doneReq yet
+    struct eventLoop *loop;
+    struct serverCtx *ctx;
 } argThread;
 
+typedef struct eventLoop {
+    int epfd, listening, wakeFd;
+    int index, sd, cpu; /// sd - the listener of the loop, cpu - where the loop runs, -1 - not pinned
+    pthread_t thread;
+    pthread_mutex_t inboxLock;
+    argThread *inbox; /// connections handed back by the pool threads and the flights
+    argThread *deferred; /// to hand to the pool or free once the events of a round are handled
+    argThread *idleHead, *idleTail; /// connections waiting for a request, oldest first
+    struct serverCtx *ctx;
+} eventLoop;
+
+typedef struct serverCtx {
+    int sd, port, stopFd, maxReq, numLoops;
+    int countReq, doneReq; /// requests taken and finished, updated atomically, maxReq 0 - unlimited
+    threadpool *tp;
+    HotCache *hot;
+    UpstreamPool *upstream;
+    CacheStore *store;
+    CacheWriter *writer;
+    FlightTable *flights;
+    Resolver *dns;
+    DecisionCache *decisions;
+    argThread *slots; /// MAX_CONNECTIONS contexts
+    int *freeSlots, freeCount; /// stack of the free slots, under slotLock
+    pthread_mutex_t slotLock;
+    Filter *filter; /// swapped atomically by the reload thread
+    int filterEpoch, filterReaders[2]; /// readers of the filter by the parity of the epoch they entered in
+    const char *filterPath;
+    pthread_t reloadThread;
+    int reloading; /// 1 - the reload thread runs
+    eventLoop loops[MAX_LOOPS];
+} serverCtx;
+
 /**
- * Initialize the lists.
- * @param host Host Link list
- * @param ip IP Link list
- * @param fp File pointer
+ * Allocate from the arena, a new block is chained if the current one is full.
+ * @param arena the arena
+ * @param size bytes to allocate
+ * @return zeroed memory, NULL if malloc failed
+ */
+void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + 15) & ~((size_t) 15);
+    ArenaBlock *block = arena->current;
+    if (block == NULL || block->used + size > block->size) {
+        size_t blockSize = (size > ARENA_BLOCK) ? size : ARENA_BLOCK;
+        ArenaBlock *newBlock = (ArenaBlock *) malloc(sizeof(ArenaBlock) + blockSize);
+        if (newBlock == NULL)
+            return NULL;
+        newBlock->size = blockSize;
+        newBlock->used = 0;
+        newBlock->next = NULL;
+        if (block == NULL)
+            arena->first = newBlock;
+        else
+            block->next = newBlock;
+        block = newBlock;
+        arena->current = block;
+    }
+    char *mem = block->data + block->used;
+    block->used += size;
+    memset(mem, 0, size);
+    arena->last = mem;
+    return mem;
+}
+
+/**
+ * Grow an allocation of the arena, in place if it is the last one.
+ * @param arena the arena
+ * @param ptr the allocation, NULL to allocate
+ * @param oldSize its size
+ * @param newSize the size needed
+ * @return the memory, NULL if malloc failed
+ */
+void *arenaRealloc(Arena *arena, void *ptr, size_t oldSize, size_t newSize) {
+    ArenaBlock *block = arena->current;
+    if (ptr != NULL && ptr == arena->last) {
+        size_t start = (char *) ptr - block->data;
+        size_t size = (newSize + 15) & ~((size_t) 15);
+        if (start + size <= block->size) {
+            if (start + size > block->used)
+                memset(block->data + block->used, 0, start + size - block->used);
+            block->used = start + size;
+            return ptr;
+        }
+    }
+    char *mem = (char *) arenaAlloc(arena, newSize);
+    if (mem != NULL && ptr != NULL)
+        memcpy(mem, ptr, oldSize);
+    return mem;
+}
+
+
+/**
+ * Copy a part of a buffer into the arena as a string.
+ * @param arena the arena
+ * @param str the start
+ * @param len its length
+ * @return the copy, NULL if failed
+ */
+char *arenaStrndup(Arena *arena, const char *str, size_t len) {
+    char *copy = (char *) arenaAlloc(arena, len + 1);
+    if (copy != NULL)
+        memcpy(copy, str, len);
+    return copy;
+}
+
+/**
+ * Release everything in the arena at once, the first block is kept for the next request.
+ * @param arena the arena
+ */
+void arenaReset(Arena *arena) {
+    if (arena->first == NULL)
+        return;
+    ArenaBlock *block = arena->first->next, *p;
+    while (block != NULL) {
+        p = block;
+        block = block->next;
+        free(p);
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->current = arena->first;
+    arena->last = NULL;
+}
+
+/**
+ * Free the arena.
+ * @param arena the arena
+ */
+void arenaFree(Arena *arena) {
+    arenaReset(arena);
+    free(arena->first);
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+/**
+ * Initialize the filters.
+ * @param host Host filter
+ * @param ip IP filter
+ * @return 0 on success, -1 otherwise
  */
-void initLists(LinkList_Host *host, LinkList_IP *ip, FILE *fp) {
+int initLists(HostFilter *host, IpFilter *ip) {
     if (host == NULL || ip == NULL) {
         fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
-        fclose(fp);
-        exit(EXIT_FAILURE);
+        return -1;
+    }
+    host->nameBuckets = HOST_BUCKETS;
+    host->labelBuckets = HOST_BUCKETS;
+    host->names = (HostName **) calloc(HOST_BUCKETS, sizeof(HostName *));
+    host->labels = (HostLabel **) calloc(HOST_BUCKETS, sizeof(HostLabel *));
+    if (host->names == NULL || host->labels == NULL) {
+        fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
+        return -1;
     }
-    host->first = NULL;
-    host->last = NULL;
     host->size = 0;
-    ip->first = NULL;
-    ip->last = NULL;
+    host->labelCount = 0;
+    host->nodes = 1;
+    ip->ranges = NULL;
     ip->size = 0;
+    ip->capacity = 0;
+    return 0;
+}
+
+/**
+ * FNV-1a hash of a cache key.
+ * @param key the key
+ * @return the hash
+ */
+unsigned long hashKey(const char *key) {
+    unsigned long hash = 14695981039346656037UL;
+    while (*key != '\0') {
+        hash ^= (u_char) *key++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * FNV-1a hash of a label of the suffix trie, seeded by its parent node.
+ * @param parent the node the label hangs from
+ * @param label the label
+ * @param len its length
+ * @return the hash
+ */
+unsigned long hashLabel(int parent, const char *label, size_t len) {
+    unsigned long hash = 14695981039346656037UL ^ (unsigned long) parent;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (u_char) label[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
 }
 
 /**
- * Add data to new node at the end of the given link list.
- * @param LinkList_Host Host Link list to add data to
- * @param LinkList_IP IP Link list to add data to
- * @param type 0 to host, 1 to IP
- * @param data Pointer to dynamically allocated data
- * @param mask to know the subnet
+ * Double the buckets of the exact names.
+ * @param host Host filter
  * @return 0 on success, 1 otherwise
  */
-int add(LinkList_Host *host, LinkList_IP *ip, int type, char *data, int mask) {
-    if (type == 0) { ///add to host list
-        NodeHost *new_node = malloc(sizeof(NodeHost));
-        if (new_node == NULL) {
-            return 1;
+int growNames(HostFilter *host) {
+    int buckets = host->nameBuckets * 2;
+    HostName **names = (HostName **) calloc(buckets, sizeof(HostName *));
+    if (names == NULL)
+        return 1;
+    for (int i = 0; i < host->nameBuckets; i++) {
+        HostName *entry = host->names[i], *next;
+        while (entry != NULL) {
+            next = entry->next;
+            entry->next = names[entry->hash % buckets];
+            names[entry->hash % buckets] = entry;
+            entry = next;
         }
-        *new_node = (NodeHost) {data, NULL};
-        if (host->first == NULL) {
-            host->first = new_node;
-            host->last = new_node;
-        } else {
-            host->last->next = new_node;
-            host->last = new_node;
+    }
+    free(host->names);
+    host->names = names;
+    host->nameBuckets = buckets;
+    return 0;
+}
+
+/**
+ * Double the buckets of the suffix trie.
+ * @param host Host filter
+ * @return 0 on success, 1 otherwise
+ */
+int growLabels(HostFilter *host) {
+    int buckets = host->labelBuckets * 2;
+    HostLabel **labels = (HostLabel **) calloc(buckets, sizeof(HostLabel *));
+    if (labels == NULL)
+        return 1;
+    for (int i = 0; i < host->labelBuckets; i++) {
+        HostLabel *edge = host->labels[i], *next;
+        while (edge != NULL) {
+            next = edge->next;
+            edge->next = labels[edge->hash % buckets];
+            labels[edge->hash % buckets] = edge;
+            edge = next;
         }
-        host->size++;
     }
-    if (type == 1) { /// add to ip list
-        NodeIP *new_node = malloc(sizeof(NodeIP));
-        if (new_node == NULL) {
-            return 1;
+    free(host->labels);
+    host->labels = labels;
+    host->labelBuckets = buckets;
+    return 0;
+}
+
+/**
+ * Find the edge of a label in the suffix trie.
+ * @param host Host filter
+ * @param parent the node the label hangs from
+ * @param label the label
+ * @param len its length
+ * @return the edge, NULL if there is none
+ */
+HostLabel *findLabel(HostFilter *host, int parent, const char *label, size_t len) {
+    unsigned long hash = hashLabel(parent, label, len);
+    HostLabel *edge = host->labels[hash % host->labelBuckets];
+    while (edge != NULL) {
+        if (edge->hash == hash && edge->parent == parent && edge->len == len && memcmp(edge->label, label, len) == 0)
+            return edge;
+        edge = edge->next;
+    }
+    return NULL;
+}
+
+/**
+ * Add a wildcard rule to the suffix trie, label by label from the right.
+ * @param host Host filter
+ * @param name the domain under the wildcard, lower case
+ * @return 0 on success, 1 otherwise
+ */
+int addSuffix(HostFilter *host, const char *name) {
+    size_t end = strlen(name);
+    int parent = 0;
+    HostLabel *edge = NULL;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+        edge = findLabel(host, parent, name + start, end - start);
+        if (edge == NULL) {
+            if (host->labelCount >= host->labelBuckets && growLabels(host) == 1)
+                return 1;
+            edge = (HostLabel *) calloc(1, sizeof(HostLabel));
+            if (edge == NULL || (edge->label = strndup(name + start, end - start)) == NULL) {
+                free(edge);
+                return 1;
+            }
+            edge->parent = parent;
+            edge->node = host->nodes++;
+            edge->len = end - start;
+            edge->hash = hashLabel(parent, edge->label, edge->len);
+            edge->next = host->labels[edge->hash % host->labelBuckets];
+            host->labels[edge->hash % host->labelBuckets] = edge;
+            host->labelCount++;
         }
-        *new_node = (NodeIP) {data, mask, NULL};
-        if (ip->first == NULL) {
-            ip->first = new_node;
-            ip->last = new_node;
+        parent = edge->node;
+        end = (start > 0) ? start - 1 : 0;
+    }
+    if (edge != NULL)
+        edge->wildcard = 1;
+    return 0;
+}
+
+/**
+ * Add a rule to the host filter, "*.domain" (or ".domain") blocks every name under domain.
+ * @param host Host filter to add to
+ * @param data the rule, it becomes lower case
+ * @return 0 on success, 1 otherwise
+ */
+int add(HostFilter *host, char *data) {
+    size_t len = strlen(data);
+    while (len > 0 && data[len - 1] == '.') /// "example.com." is "example.com".
+        data[--len] = '\0';
+    for (size_t i = 0; i < len; i++)
+        data[i] = (char) tolower((u_char) data[i]);
+    if (strncmp(data, "*.", 2) == 0)
+        return addSuffix(host, data + 2);
+    if (data[0] == '.')
+        return addSuffix(host, data + 1);
+    unsigned long hash = hashKey(data);
+    HostName *entry;
+    for (entry = host->names[hash % host->nameBuckets]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->name, data) == 0)
+            return 0;
+    }
+    if (host->size >= host->nameBuckets && growNames(host) == 1)
+        return 1;
+    entry = (HostName *) malloc(sizeof(HostName));
+    if (entry == NULL || (entry->name = strdup(data)) == NULL) {
+        free(entry);
+        return 1;
+    }
+    entry->hash = hash;
+    entry->next = host->names[hash % host->nameBuckets];
+    host->names[hash % host->nameBuckets] = entry;
+    host->size++;
+    return 0;
+}
+
+/**
+ * Check a name against the host filter, the exact names and then the wildcard rules.
+ * @param host Host filter
+ * @param address the name
+ * @return 0 - the name is legal, 1 - the name is illegal
+ */
+int searchHost(HostFilter *host, const char *address) {
+    char name[HOST_NAME_MAX_LEN + 1];
+    size_t len = strlen(address);
+    if (len > HOST_NAME_MAX_LEN)
+        return 0;
+    for (size_t i = 0; i < len; i++)
+        name[i] = (char) tolower((u_char) address[i]);
+    while (len > 0 && name[len - 1] == '.')
+        len--;
+    name[len] = '\0';
+    unsigned long hash = hashKey(name);
+    for (HostName *entry = host->names[hash % host->nameBuckets]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return 1;
+    }
+    size_t end = len;
+    int parent = 0;
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.')
+            start--;
+        HostLabel *edge = findLabel(host, parent, name + start, end - start);
+        if (edge == NULL)
+            return 0;
+        if (edge->wildcard && start > 0) /// There are more labels under the rule.
+            return 1;
+        parent = edge->node;
+        end = (start > 0) ? start - 1 : 0;
+    }
+    return 0;
+}
+
+/**
+ * Add the range of a subnet to the IP filter.
+ * @param ip IP filter to add to
+ * @param address the address of the subnet, host byte order
+ * @param mask the prefix length, 0 - 32
+ * @return 0 on success, 1 otherwise
+ */
+int addRange(IpFilter *ip, uint32_t address, int mask) {
+    if (ip->size == ip->capacity) {
+        int capacity = (ip->capacity == 0) ? 64 : ip->capacity * 2;
+        IpRange *ranges = (IpRange *) realloc(ip->ranges, capacity * sizeof(IpRange));
+        if (ranges == NULL)
+            return 1;
+        ip->ranges = ranges;
+        ip->capacity = capacity;
+    }
+    uint32_t bits = (mask == 0) ? 0 : 0xFFFFFFFFu << (32 - mask);
+    ip->ranges[ip->size].first = address & bits;
+    ip->ranges[ip->size].last = (address & bits) | ~bits;
+    ip->size++;
+    return 0;
+}
+
+/**
+ * Order of the ranges for qsort.
+ * @param a IpRange
+ * @param b IpRange
+ * @return by the first address, then the longer range first
+ */
+int compareRange(const void *a, const void *b) {
+    const IpRange *r1 = (const IpRange *) a, *r2 = (const IpRange *) b;
+    if (r1->first != r2->first)
+        return (r1->first < r2->first) ? -1 : 1;
+    if (r1->last != r2->last)
+        return (r1->last > r2->last) ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Sort the ranges and merge the ones that overlap or touch, so a lookup is one binary search.
+ * @param ip IP filter
+ */
+void compileIpFilter(IpFilter *ip) {
+    if (ip->size == 0)
+        return;
+    qsort(ip->ranges, ip->size, sizeof(IpRange), compareRange);
+    int merged = 0;
+    for (int i = 1; i < ip->size; i++) {
+        IpRange *last = &ip->ranges[merged];
+        if (last->last == 0xFFFFFFFFu || ip->ranges[i].first <= last->last + 1) {
+            if (ip->ranges[i].last > last->last)
+                last->last = ip->ranges[i].last;
         } else {
-            ip->last->next = new_node;
-            ip->last = new_node;
+            ip->ranges[++merged] = ip->ranges[i];
         }
-        ip->size++;
     }
-    return 0;
+    ip->size = merged + 1;
 }
 
 /**
  * Check if there are web sites we would like to block.
  * @param fp File pointer
- * @return 1 no filter, 0 otherwise
+ * @return 1 no filter, 0 otherwise, -1 if failed
  */
 int checkFilter(FILE *fp) {
     int unFilter = 0;
     if (fseek(fp, 0L, SEEK_END) != 0) {
         perror("error: fseek\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     int fileSize = (int) ftell(fp);
     if (fileSize == 0) {
         unFilter = 1;
-        fclose(fp);
         return unFilter;
     }
     if (fseek(fp, 0, SEEK_SET) != 0) {
         perror("error: fseek\n");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     return unFilter;
 }
 
 /**
- * Prefix analysis of IP address.
- * @param ip IP address
- * @param mask Mask of the IP address
- */
-void parseIp(char *ip, int mask) {
-    char copy[16], *byte1, *byte2, *byte3, *byte4;
-    memset(copy, '\0', 16);
-    strncpy(copy, ip, strlen(ip));
-    double whichByte;
-    int num, bin = 256, andNum = 0;
-    byte1 = strtok(copy, ".");
-    byte2 = strtok(NULL, ".");
-    byte3 = strtok(NULL, ".");
-    byte4 = strtok(NULL, " ");
-    whichByte = (double) mask / 8;
-    mask %= 8;
-    if (mask == 0) {
-        andNum = 255;
-    }
-    for (int i = 0; i < mask; i++) {
-        bin /= 2;
-        andNum += bin;
-    }
-    if (whichByte >= 0 && whichByte <= 1) { ///in byte1
-        byte2 = "0";
-        byte3 = "0";
-        byte4 = "0";
-        num = (int) strtol(byte1, NULL, 10);
-        num = num & andNum;
-        sprintf(byte1, "%d", num);
-    }
-    if (whichByte > 1 && whichByte <= 2) { ///in byte2
-        byte3 = "0";
-        byte4 = "0";
-        num = (int) strtol(byte2, NULL, 10);
-        num = num & andNum;
-        sprintf(byte2, "%d", num);
-    }
-    if (whichByte > 2 && whichByte <= 3) { ///in byte3
-        byte4 = "0";
-        num = (int) strtol(byte3, NULL, 10);
-        num = num & andNum;
-        sprintf(byte3, "%d", num);
-    }
-    if (whichByte > 3 && whichByte <= 4) { ///in byte4
-        num = (int) strtol(byte4, NULL, 10);
-        num = num & andNum;
-        sprintf(byte4, "%d", num);
-    }
-    memset(ip, '\0', strlen(ip));
-    sprintf(ip, "%s.%s.%s.%s", byte1, byte2, byte3, byte4);
-}
-
-/**
- * Fills the lists by hostName and IP.
+ * Fills the lists by hostName and IP, the IP rules are compiled into sorted ranges.
  * @param fp File pointer
- * @param host Host Link list to add data to
- * @param ip IP Link list to add data to
+ * @param host Host filter to add data to
+ * @param ip IP filter to add data to
+ * @return 0 on success, -1 otherwise
  */
-void makeFilter(FILE *fp, LinkList_Host *host, LinkList_IP *ip) {
+int makeFilter(FILE *fp, HostFilter *host, IpFilter *ip) {
     char *token, *mask, *line = NULL;
     size_t len = 0;
-    int subnet, flag; /// 0 to Host, 1 to IP
     while (getline(&line, &len, fp) != -1) {
         if ((line[0] > 47) && (line[0] < 58)) { /// IP
-            flag = 1;
-            token = strtok(line, "/");
-            mask = strtok(NULL, " ");
-            subnet = (int) strtol(mask, NULL, 10);
-            parseIp(token, subnet);
-        } else { /// Host
-            flag = 0;
-            token = strtok(line, "\r\n");
-        }
-        char *tokenToAdd = (char *) malloc(strlen(token) + 1);
-        if (tokenToAdd == NULL) {
-            fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
-            exit(EXIT_FAILURE);
-        }
-        strcpy(tokenToAdd, token);
-        tokenToAdd[strlen(token)] = '\0';
-        if (flag == 0) {
-            if (add(host, ip, 0, tokenToAdd, subnet) == 1) {
-                fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
-                exit(EXIT_FAILURE);
+            struct in_addr address;
+            token = strtok(line, "/ \t\r\n");
+            mask = strtok(NULL, " \t\r\n");
+            int subnet = (mask == NULL) ? 32 : (int) strtol(mask, NULL, 10);
+            if (inet_pton(AF_INET, token, &address) != 1 || subnet < 0 || subnet > 32) {
+                fprintf(stderr, "filter: bad subnet %s\n", token);
+                continue;
             }
-        }
-        if (flag == 1) {
-            if (add(host, ip, 1, tokenToAdd, subnet) == 1) {
+            if (addRange(ip, ntohl(address.s_addr), subnet) == 1) {
                 fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
-                exit(EXIT_FAILURE);
+                free(line);
+                return -1;
             }
+            continue;
+        }
+        token = strtok(line, " \t\r\n"); /// Host
+        if (token == NULL)
+            continue;
+        if (add(host, token) == 1) {
+            fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
+            free(line);
+            return -1;
         }
     }
     free(line);
-    fclose(fp);
+    compileIpFilter(ip);
+    return 0;
 }
 
 /**
- * Free the link lists.
- * @param host Host Link list to free
- * @param ip IP Link list to free
+ * Free a filter snapshot.
+ * @param filter the snapshot to free
  */
-void free_LinkList(LinkList_Host *host, LinkList_IP *ip) {
+void freeFilter(Filter *filter) {
+    if (filter == NULL)
+        return;
+    HostFilter *host = filter->host;
+    IpFilter *ip = filter->ip;
     if (host != NULL) {
-        NodeHost *headHost = host->first, *p;
-        while (headHost != NULL) {
-            p = headHost;
-            headHost = headHost->next;
-            free(p->data);
-            p->data = NULL;
-            free(p);
-            p = NULL;
+        for (int i = 0; host->names != NULL && i < host->nameBuckets; i++) {
+            HostName *entry = host->names[i], *p;
+            while (entry != NULL) {
+                p = entry;
+                entry = entry->next;
+                free(p->name);
+                free(p);
+            }
+        }
+        for (int i = 0; host->labels != NULL && i < host->labelBuckets; i++) {
+            HostLabel *edge = host->labels[i], *q;
+            while (edge != NULL) {
+                q = edge;
+                edge = edge->next;
+                free(q->label);
+                free(q);
+            }
         }
+        free(host->names);
+        free(host->labels);
         free(host);
     }
     if (ip != NULL) {
-        NodeIP *headIP = ip->first, *q;
-        while (headIP != NULL) {
-            q = headIP;
-            headIP = headIP->next;
-            free(q->data);
-            q->data = NULL;
-            free(q);
-            q = NULL;
-        }
+        free(ip->ranges);
         free(ip);
     }
+    free(filter);
+}
+
+/**
+ * Read the filter file into a new snapshot.
+ * @param path the filter file
+ * @param generation number of the snapshot
+ * @return the snapshot, NULL if failed
+ */
+Filter *loadFilter(const char *path, unsigned long generation) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen: failed");
+        return NULL;
+    }
+    Filter *filter = (Filter *) calloc(1, sizeof(Filter));
+    if (filter == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    filter->generation = generation;
+    filter->unFilter = checkFilter(fp); ///return 1 if the filter is empty.
+    if (filter->unFilter == 0) {
+        filter->host = (HostFilter *) calloc(1, sizeof(HostFilter));
+        filter->ip = (IpFilter *) calloc(1, sizeof(IpFilter));
+        if (initLists(filter->host, filter->ip) == -1 || makeFilter(fp, filter->host, filter->ip) == -1)
+            filter->unFilter = -1;
+    }
+    fclose(fp);
+    if (filter->unFilter == -1) {
+        freeFilter(filter);
+        return NULL;
+    }
+    return filter;
 }
 
 /**
@@ -299,6 +1050,10 @@ void handleError(char *buf, int num) {
         strcpy(type, "501 Not supported");
         strcpy(notice, "Method is not supported.");
     }
+    if (num == 503) {
+        strcpy(type, "503 Service Unavailable");
+        strcpy(notice, "Server is busy.");
+    }
     len = strlen(html) + (2 * strlen(type)) + strlen(notice);
     memset(buf, '\0', 512);
     sprintf(buf, "HTTP/1.0 %s\r\nContent-Type: text/html\nContent-Length: %zu\nConnection: close\r\n\r\n"
@@ -308,21 +1063,15 @@ void handleError(char *buf, int num) {
 
 /**
  * Sending a specific error to the socket.
+ * The memory of the request is in its arena and is released with it.
  * @param errNum type of the error
  * @param sd socket descriptor
- * @param str1ToStr4 char* to free
- * @param url URL struct
  */
-void sendError(int errNum, int sd, char *str1, char *str2, char *str3, char *str4, URL *url) {
+void sendError(int errNum, int sd) {
     char handle[512];
     handleError(handle, errNum);
     write(sd, handle, strlen(handle));
     close(sd);
-    if (str1 != NULL) free(str1);
-    if (str2 != NULL) free(str2);
-    if (str3 != NULL) free(str3);
-    if (str4 != NULL) free(str4);
-    if (url != NULL) free(url);
 }
 
 /**
@@ -347,650 +1096,4545 @@ char *get_mime_type(char *name) {
 }
 
 /**
- * Convert name to IP.
- * @param hostName the domain
- * @return IP address
+ * Create the resolver.
+ * @return the resolver, NULL if failed
  */
-char *nameToAddress(char *hostName) {
-    struct hostent *hp;
-    struct in_addr address;
-    char *ip;
-    hp = gethostbyname(hostName);
-    if (hp == NULL) {
-        herror("failed: gethostbyname\n");
-        exit(EXIT_FAILURE);
-    }
-    while (*hp->h_addr_list) {
-        bcopy(*hp->h_addr_list++, (char *) &address, sizeof(address));
-        ip = (char *) malloc(strlen(inet_ntoa(address)) + 1);
-        if (ip == NULL)
-            return NULL;
-        memcpy(ip, inet_ntoa(address), strlen(inet_ntoa(address)));
-        ip[strlen(inet_ntoa(address))] = '\0';
+Resolver *dnsCreate() {
+    Resolver *dns = (Resolver *) calloc(1, sizeof(Resolver));
+    if (dns == NULL)
+        return NULL;
+    pthread_mutex_init(&dns->lock, NULL);
+    pthread_cond_init(&dns->resolved, NULL);
+    return dns;
+}
+
+/**
+ * Free a lookup that ended.
+ * @param query the lookup
+ */
+void dnsQueryFree(DnsQuery *query) {
+    if (query->request.ar_result != NULL)
+        freeaddrinfo(query->request.ar_result);
+    free(query->name);
+    free(query);
+}
+
+/**
+ * Free the lookups that were given up and ended since, called with the lock held.
+ * @param dns the resolver
+ */
+void dnsReap(Resolver *dns) {
+    DnsQuery **link = &dns->abandoned;
+    while (*link != NULL) {
+        DnsQuery *query = *link;
+        if (gai_error(&query->request) != EAI_INPROGRESS) {
+            *link = query->next;
+            dnsQueryFree(query);
+        } else {
+            link = &query->next;
+        }
     }
-    return ip;
 }
 
 /**
- * Checking if the address is in the filter file(only in IP list).
- * @param ip IP Link list
- * @param address the address to check
- * @return 0 - the address is legal, 1 - the address is illegal, -1 - if malloc failed
+ * Free the resolver and its names, the lookups that were given up are waited for.
+ * @param dns the resolver
  */
-int searchAddressInIpList(LinkList_IP *ip, char *address) {
-    char *copy = (char *) malloc(strlen(address) + 1);
-    if (copy == NULL)
-        return -1;
-    NodeIP *headIP = ip->first, *p;
-    while (headIP != NULL) {
-        p = headIP;
-        headIP = headIP->next;
-        memcpy(copy, address, strlen(address));
-        copy[strlen(address)] = '\0';
-        parseIp(copy, p->mask);
-        if (strcmp(p->data, copy) == 0) {
-            free(copy);
-            return 1;
+void dnsFree(Resolver *dns) {
+    if (dns == NULL)
+        return;
+    while (dns->abandoned != NULL) {
+        DnsQuery *query = dns->abandoned;
+        const struct gaicb *wait[1] = {&query->request};
+        dns->abandoned = query->next;
+        while (gai_error(&query->request) == EAI_INPROGRESS)
+            gai_suspend(wait, 1, NULL);
+        dnsQueryFree(query);
+    }
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry *entry = dns->buckets[i], *next;
+        while (entry != NULL) {
+            next = entry->next;
+            free(entry->name);
+            free(entry);
+            entry = next;
         }
     }
-    free(copy);
-    return 0;
+    pthread_mutex_destroy(&dns->lock);
+    pthread_cond_destroy(&dns->resolved);
+    free(dns);
 }
 
 /**
- * Checking if the address is in the filter file.
- * @param host Host Link list
- * @param ip IP Link list
- * @param address the address to check
- * @return 0 - the address is legal, 1 - the address is illegal, -1 - if malloc failed
- */
-int searchAddressInFilter(LinkList_Host *host, LinkList_IP *ip, char *address) {
-    int searchInIp;
-    char *ipAdd;
-    if (address[0] < 48 || address[0] > 57) {
-        NodeHost *headHost = host->first, *p;
-        while (headHost != NULL) {
-            p = headHost;
-            headHost = headHost->next;
-            if (strcmp(p->data, address) == 0) {
-                return 1;
+ * Remove the expired names to make room, called with the lock held.
+ * @param dns the resolver
+ * @param now the time
+ */
+void dnsPurge(Resolver *dns, time_t now) {
+    for (int i = 0; i < DNS_BUCKETS; i++) {
+        DnsEntry **link = &dns->buckets[i];
+        while (*link != NULL) {
+            DnsEntry *entry = *link;
+            if (entry->state != DNS_PENDING && !entry->refreshing && entry->waiters == 0 && entry->expires <= now) {
+                *link = entry->next;
+                free(entry->name);
+                free(entry);
+                dns->count--;
+            } else {
+                link = &entry->next;
             }
         }
-        ipAdd = nameToAddress(address);
-        if (ipAdd == NULL)
-            return -1;
-        searchInIp = searchAddressInIpList(ip, ipAdd);
-        free(ipAdd);
-        return searchInIp;
     }
-    searchInIp = searchAddressInIpList(ip, address);
-    return searchInIp;
 }
 
 /**
- * Open server to accept clients.
- * @param port the port that server listen to
- * @return sd, -1 if any syscall failure
+ * Resolve a name to its IPv4 address, without the cache.
+ * getaddrinfo_a is thread safe, unlike gethostbyname, and the wait for it is bounded: a lookup
+ * that takes more than DNS_TIMEOUT fails, and what it holds is freed once it ends.
+ * @param dns the resolver
+ * @param host the name or a dotted address
+ * @param addr the address
+ * @return 0 - found, 1 - the name doesn't exist, -1 - the lookup failed
  */
-int openServer(int port) {
-    int sd;
-    struct sockaddr_in srv;
-    if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("error: socket\n");
+int dnsLookup(Resolver *dns, const char *host, struct in_addr *addr) {
+    DnsQuery *query = (DnsQuery *) calloc(1, sizeof(DnsQuery));
+    if (query == NULL || (query->name = strdup(host)) == NULL) {
+        free(query);
         return -1;
     }
-    srv.sin_family = AF_INET;
-    srv.sin_port = htons(port);
-    srv.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(sd, (struct sockaddr *) &srv, sizeof(srv)) < 0) {
-        perror("error: bind\n");
+    query->hints.ai_family = AF_INET;
+    query->hints.ai_socktype = SOCK_STREAM;
+    query->request.ar_name = query->name;
+    query->request.ar_request = &query->hints;
+    struct gaicb *list[1] = {&query->request};
+    const struct gaicb *wait[1] = {&query->request};
+    struct timespec timeout = {DNS_TIMEOUT, 0};
+    if (getaddrinfo_a(GAI_NOWAIT, list, 1, NULL) != 0) {
+        dnsQueryFree(query);
         return -1;
     }
-    if (listen(sd, 5) < 0) {
-        perror("error: listen\n");
-        return -1;
+    int check;
+    while ((check = gai_error(&query->request)) == EAI_INPROGRESS) {
+        int suspend = gai_suspend(wait, 1, &timeout);
+        if (suspend == EAI_AGAIN && gai_error(&query->request) == EAI_INPROGRESS) { /// Too slow.
+            if (gai_cancel(&query->request) == EAI_CANCELED) {
+                dnsQueryFree(query);
+            } else { /// It is running, its memory is freed once it ends.
+                pthread_mutex_lock(&dns->lock);
+                query->next = dns->abandoned;
+                dns->abandoned = query;
+                pthread_mutex_unlock(&dns->lock);
+            }
+            return -1;
+        }
     }
-    return sd;
+    if (check == 0)
+        *addr = ((struct sockaddr_in *) query->request.ar_result->ai_addr)->sin_addr;
+    dnsQueryFree(query);
+    if (check != 0)
+        return (check == EAI_NONAME || check == EAI_NODATA || check == EAI_FAIL) ? 1 : -1;
+    return 0;
 }
 
 /**
- * Connect to the server.
- * @param hostName the domain.
- * @return fd of socket, -1 if failed
+ * Resolve a name through the cache.
+ * A name is looked up by one thread at a time, the others wait for its answer. A name that
+ * doesn't exist is remembered for DNS_NEGATIVE_TTL, an address for DNS_TTL, after that the
+ * first thread resolves it again while the others keep using the old address. A lookup that
+ * failed is only the answer of the threads that waited for it, the next request tries again.
+ * @param dns the resolver
+ * @param host the name or a dotted address
+ * @param addr the address
+ * @return 0 - found, 1 - the name doesn't exist, -1 - the lookup failed
  */
-int connectToServer(char *hostName) {
-    int fd;
-    struct sockaddr_in sd_socket;
-    struct hostent *hp;
-    sd_socket.sin_family = AF_INET;
-    if (isdigit(hostName[0])) {
-        struct in_addr address;
-        inet_aton(hostName, &address);
-        hp = gethostbyaddr(&address, sizeof(address), AF_INET);
-    } else {
-        hp = gethostbyname(hostName);
+int resolveHost(Resolver *dns, const char *host, struct in_addr *addr) {
+    if (inet_aton(host, addr) != 0) /// Nothing to resolve.
+        return 0;
+    unsigned long hash = hashKey(host);
+    DnsEntry *entry;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&dns->lock);
+    for (entry = dns->buckets[hash % DNS_BUCKETS]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->name, host) == 0)
+            break;
     }
-    if (hp == NULL) {
-        herror("failed: gethostbyname\n");
-        exit(EXIT_FAILURE);
+    if (entry != NULL) {
+        int waited = 0;
+        entry->waiters++;
+        while (entry->state == DNS_PENDING) {
+            pthread_cond_wait(&dns->resolved, &dns->lock);
+            waited = 1;
+        }
+        entry->waiters--;
+        now = time(NULL);
+        if (waited && entry->state == DNS_FAILED) {
+            pthread_mutex_unlock(&dns->lock);
+            return -1;
+        }
+        if ((entry->state != DNS_FAILED && entry->expires > now) ||
+            (entry->state == DNS_FOUND && entry->refreshing)) {
+            int found = (entry->state == DNS_FOUND);
+            *addr = entry->addr;
+            pthread_mutex_unlock(&dns->lock);
+            return found ? 0 : 1;
+        }
+        if (entry->state == DNS_FOUND)
+            entry->refreshing = 1;
+        else
+            entry->state = DNS_PENDING;
+    } else {
+        dnsReap(dns);
+        if (dns->count >= DNS_CACHE_MAX)
+            dnsPurge(dns, now);
+        if (dns->count >= DNS_CACHE_MAX) { /// Full of live names, resolve without caching.
+            pthread_mutex_unlock(&dns->lock);
+            return dnsLookup(dns, host, addr);
+        }
+        entry = (DnsEntry *) calloc(1, sizeof(DnsEntry));
+        if (entry == NULL || (entry->name = strdup(host)) == NULL) {
+            free(entry);
+            pthread_mutex_unlock(&dns->lock);
+            return dnsLookup(dns, host, addr);
+        }
+        entry->hash = hash;
+        entry->state = DNS_PENDING;
+        entry->next = dns->buckets[hash % DNS_BUCKETS];
+        dns->buckets[hash % DNS_BUCKETS] = entry;
+        dns->count++;
     }
-    sd_socket.sin_addr.s_addr = ((struct in_addr *) (hp->h_addr))->s_addr;
-    sd_socket.sin_port = htons(80);
+    pthread_mutex_unlock(&dns->lock);
 
-    if ((fd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("error: socket\n");
-        return -1;
-    }
-    if (connect(fd, (struct sockaddr *) &sd_socket, sizeof(sd_socket)) < 0) {
-        perror("error: connect\n");
-        return -1;
+    struct in_addr found;
+    int check = dnsLookup(dns, host, &found);
+    pthread_mutex_lock(&dns->lock);
+    now = time(NULL);
+    if (check == 0) {
+        entry->state = DNS_FOUND;
+        entry->addr = found;
+        entry->expires = now + DNS_TTL;
+    } else if (check == 1) {
+        entry->state = DNS_MISSING;
+        entry->expires = now + DNS_NEGATIVE_TTL;
+    } else if (entry->state == DNS_PENDING) { /// A failed lookup is not remembered, the next request tries again.
+        entry->state = DNS_FAILED;
+        entry->expires = now;
     }
-    return fd;
+    entry->refreshing = 0;
+    if (check == -1 && entry->state == DNS_FOUND) /// Keep the old address until the server answers.
+        check = 0;
+    *addr = entry->addr;
+    pthread_cond_broadcast(&dns->resolved);
+    pthread_mutex_unlock(&dns->lock);
+    return check;
 }
 
 /**
- * Request analysis to check if it is valid for sending.
- * @param req the request to parsing
- * @param clientSd the socket
- * @param unFilter to know if we have filter, 0 - have, 1 - there is no
- * @param host_list Host Link list
- * @param ip_list IP Link list
- * @return struct URL, NULL if failed
+ * Create the decision cache.
+ * @return the cache, NULL if failed
  */
-URL *parseRequest(char **req, int clientSd, int unFilter, LinkList_Host *host_list, LinkList_IP *ip_list) {
-    URL *url;
-    url = (URL *) calloc(1, sizeof(URL));
-    if (url == NULL) {
-        sendError(500, clientSd, NULL, NULL, NULL, NULL, NULL);
+DecisionCache *decisionCreate() {
+    DecisionCache *cache = (DecisionCache *) calloc(1, sizeof(DecisionCache));
+    if (cache == NULL)
         return NULL;
+    for (int i = 0; i < DECISION_SHARDS; i++) {
+        pthread_mutex_init(&cache->shards[i].lock, NULL);
     }
-    char *copy = malloc(strlen(*req) + 1);
-    if (copy == NULL) {
-        sendError(500, clientSd, NULL, NULL, NULL, NULL, url);
-        return NULL;
+    return cache;
+}
+
+/**
+ * Free the decision cache.
+ * @param cache the cache
+ */
+void decisionFree(DecisionCache *cache) {
+    if (cache == NULL)
+        return;
+    for (int i = 0; i < DECISION_SHARDS; i++) {
+        Decision *entry = cache->shards[i].oldest, *next;
+        while (entry != NULL) {
+            next = entry->newer;
+            free(entry->host);
+            free(entry);
+            entry = next;
+        }
+        pthread_mutex_destroy(&cache->shards[i].lock);
+    }
+    free(cache);
+}
+
+/**
+ * Take a decision out of its shard, called with the shard locked.
+ * @param shard the shard
+ * @param entry the decision
+ */
+void decisionUnlink(DecisionShard *shard, Decision *entry) {
+    Decision **link = &shard->buckets[(entry->hash / DECISION_SHARDS) % DECISION_BUCKETS];
+    while (*link != entry)
+        link = &(*link)->hnext;
+    *link = entry->hnext;
+    if (entry->older != NULL) entry->older->newer = entry->newer;
+    else shard->oldest = entry->newer;
+    if (entry->newer != NULL) entry->newer->older = entry->older;
+    else shard->newest = entry->older;
+    shard->count--;
+}
+
+/**
+ * Find what is known about a host under the current filter.
+ * @param cache the cache
+ * @param host the host
+ * @param generation the generation of the current filter
+ * @param addr set to the address when the host is allowed
+ * @return DECISION_ALLOWED, DECISION_BLOCKED, DECISION_MISSING, -1 - unknown
+ */
+int decisionGet(DecisionCache *cache, const char *host, unsigned long generation, struct in_addr *addr) {
+    unsigned long hash = hashKey(host);
+    DecisionShard *shard = &cache->shards[hash % DECISION_SHARDS];
+    int verdict = -1;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&shard->lock);
+    Decision *entry = shard->buckets[(hash / DECISION_SHARDS) % DECISION_BUCKETS];
+    while (entry != NULL && !(entry->hash == hash && strcmp(entry->host, host) == 0))
+        entry = entry->hnext;
+    if (entry != NULL) {
+        if (entry->expires > now && (entry->generation == generation || entry->verdict == DECISION_MISSING)) {
+            verdict = entry->verdict;
+            *addr = entry->addr;
+        } else { /// Expired, or made by an older filter.
+            decisionUnlink(shard, entry);
+            free(entry->host);
+            free(entry);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return verdict;
+}
+
+/**
+ * Remember what is known about a host, the oldest host of the shard goes when it is full.
+ * @param cache the cache
+ * @param host the host
+ * @param generation the generation of the filter that decided
+ * @param verdict DECISION_ALLOWED, DECISION_BLOCKED or DECISION_MISSING
+ * @param addr the address when the host is allowed
+ */
+void decisionPut(DecisionCache *cache, const char *host, unsigned long generation, int verdict, struct in_addr addr) {
+    unsigned long hash = hashKey(host);
+    DecisionShard *shard = &cache->shards[hash % DECISION_SHARDS];
+    Decision *entry = (Decision *) calloc(1, sizeof(Decision));
+    if (entry == NULL || (entry->host = strdup(host)) == NULL) {
+        free(entry);
+        return;
+    }
+    entry->hash = hash;
+    entry->generation = generation;
+    entry->verdict = verdict;
+    entry->addr = addr;
+    entry->expires = time(NULL) + ((verdict == DECISION_MISSING) ? DNS_NEGATIVE_TTL : DECISION_TTL);
+    pthread_mutex_lock(&shard->lock);
+    Decision **bucket = &shard->buckets[(hash / DECISION_SHARDS) % DECISION_BUCKETS], *old = *bucket;
+    while (old != NULL && !(old->hash == hash && strcmp(old->host, host) == 0))
+        old = old->hnext;
+    if (old != NULL || shard->count >= DECISION_SHARD_MAX) {
+        if (old == NULL)
+            old = shard->oldest;
+        decisionUnlink(shard, old);
+        free(old->host);
+        free(old);
+    }
+    entry->hnext = *bucket;
+    *bucket = entry;
+    entry->older = shard->newest;
+    if (shard->newest != NULL) shard->newest->newer = entry;
+    else shard->oldest = entry;
+    shard->newest = entry;
+    shard->count++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Checking if the address is in the filter file(only in IP list), a binary search of the ranges.
+ * @param ip IP filter
+ * @param addr the address to check
+ * @return 0 - the address is legal, 1 - the address is illegal
+ */
+int searchAddressInIpList(IpFilter *ip, struct in_addr addr) {
+    uint32_t address = ntohl(addr.s_addr);
+    int low = 0, high = ip->size - 1;
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        if (address < ip->ranges[mid].first)
+            high = mid - 1;
+        else if (address > ip->ranges[mid].last)
+            low = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Checking if the address is in the filter file.
+ * @param host Host filter
+ * @param ip IP filter
+ * @param address the address to check
+ * @param addr the resolved address of it
+ * @return 0 - the address is legal, 1 - the address is illegal
+ */
+int searchAddressInFilter(HostFilter *host, IpFilter *ip, char *address, struct in_addr addr) {
+    if ((address[0] < 48 || address[0] > 57) && searchHost(host, address) == 1)
+        return 1;
+    return searchAddressInIpList(ip, addr);
+}
+
+/**
+ * Open server to accept clients.
+ * Every event loop opens its own listener on the port with SO_REUSEPORT, and the kernel
+ * spreads the connections between them. TCP_DEFER_ACCEPT and TCP_FASTOPEN are best effort.
+ * @param port the port that server listen to
+ * @return sd, -1 if any syscall failure
+ */
+int openServer(int port) {
+    int sd, on = 1, defer = LISTEN_DEFER_ACCEPT, fastOpen = LISTEN_FASTOPEN;
+    struct sockaddr_in srv;
+    memset(&srv, 0, sizeof(srv));
+    if ((sd = socket(PF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("error: socket\n");
+        return -1;
+    }
+    if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("error: setsockopt SO_REUSEPORT\n");
+        close(sd);
+        return -1;
+    }
+    if (defer > 0 && setsockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0)
+        perror("setsockopt: TCP_DEFER_ACCEPT is off\n");
+    if (fastOpen > 0 && setsockopt(sd, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) < 0)
+        perror("setsockopt: TCP_FASTOPEN is off\n");
+    srv.sin_family = AF_INET;
+    srv.sin_port = htons(port);
+    srv.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(sd, (struct sockaddr *) &srv, sizeof(srv)) < 0) {
+        perror("error: bind\n");
+        close(sd);
+        return -1;
+    }
+    if (listen(sd, LISTEN_BACKLOG) < 0) {
+        perror("error: listen\n");
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * Find the next LF, 16 bytes at a time where SSE2 is there.
+ * @param p where to start
+ * @param end the end of the data
+ * @return the LF, NULL if there is none
+ */
+const char *findLF(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), lf));
+        if (bits != 0)
+            return p + __builtin_ctz(bits);
+        p += 16;
+    }
+#endif
+    return (const char *) memchr(p, '\n', end - p);
+}
+
+/**
+ * Start parsing a new request.
+ * @param parser the parser
+ */
+void requestReset(RequestParser *parser) {
+    parser->state = REQ_LINE;
+    parser->scanned = 0;
+    parser->lineStart = 0;
+    parser->headLen = 0;
+    parser->headerCount = 0;
+}
+
+/**
+ * Parse one line of the head, without its CRLF.
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param start the offset of the line
+ * @param end the offset of its end
+ * @return 0 - more lines, 1 - the head ended, -1 - bad line
+ */
+int requestLine(RequestParser *parser, const char *buf, size_t start, size_t end) {
+    if (parser->state == REQ_LINE) {
+        if (start == end) /// Empty lines before the request line are allowed.
+            return 0;
+        const char *line = buf + start, *sp1 = memchr(line, ' ', end - start), *sp2;
+        if (sp1 == NULL || (sp2 = memchr(sp1 + 1, ' ', buf + end - sp1 - 1)) == NULL || sp1 == line ||
+            sp2 == sp1 + 1 || sp2 + 1 == buf + end || memchr(sp2 + 1, ' ', buf + end - sp2 - 1) != NULL)
+            return -1;
+        parser->method = (Span) {(uint32_t) start, (uint32_t) (sp1 - line)};
+        parser->path = (Span) {(uint32_t) (sp1 + 1 - buf), (uint32_t) (sp2 - sp1 - 1)};
+        parser->version = (Span) {(uint32_t) (sp2 + 1 - buf), (uint32_t) (buf + end - sp2 - 1)};
+        parser->state = REQ_HEADERS;
+        return 0;
+    }
+    if (start == end)
+        return 1;
+    const char *line = buf + start, *colon = memchr(line, ':', end - start);
+    if (colon == NULL || colon == line || *line == ' ' || *line == '\t' ||
+        parser->headerCount == MAX_REQUEST_HEADERS)
+        return -1;
+    size_t valueStart = colon + 1 - buf, valueEnd = end;
+    while (valueStart < valueEnd && (buf[valueStart] == ' ' || buf[valueStart] == '\t'))
+        valueStart++;
+    while (valueEnd > valueStart && (buf[valueEnd - 1] == ' ' || buf[valueEnd - 1] == '\t'))
+        valueEnd--;
+    parser->names[parser->headerCount] = (Span) {(uint32_t) start, (uint32_t) (colon - line)};
+    parser->values[parser->headerCount] = (Span) {(uint32_t) valueStart, (uint32_t) (valueEnd - valueStart)};
+    parser->headerCount++;
+    return 0;
+}
+
+/**
+ * Parse the bytes that arrived since the last call, only the new bytes are scanned.
+ * @param parser the parser
+ * @param buf the request buffer
+ * @param len the bytes in it
+ * @return 1 - the head is complete (or bad, REQ_ERROR), 0 - wait for more
+ */
+int requestParse(RequestParser *parser, const char *buf, size_t len) {
+    while (parser->state == REQ_LINE || parser->state == REQ_HEADERS) {
+        const char *lf = findLF(buf + parser->scanned, buf + len);
+        if (lf == NULL) {
+            parser->scanned = len;
+            if (len > MAX_REQUEST_HEAD) {
+                parser->state = REQ_ERROR;
+                break;
+            }
+            return 0;
+        }
+        size_t end = lf - buf, lineEnd = end;
+        if (lineEnd > parser->lineStart && buf[lineEnd - 1] == '\r')
+            lineEnd--;
+        int check = (end >= MAX_REQUEST_HEAD) ? -1 : requestLine(parser, buf, parser->lineStart, lineEnd);
+        parser->scanned = end + 1;
+        parser->lineStart = end + 1;
+        if (check == -1) {
+            parser->state = REQ_ERROR;
+        } else if (check == 1) {
+            parser->state = REQ_DONE;
+            parser->headLen = end + 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find a header of the request.
+ * @param parser the parser, REQ_DONE
+ * @param buf the request buffer
+ * @param name the name of the header
+ * @param len set to the length of the value
+ * @return the value (not NUL terminated), NULL if there is no such header
+ */
+const char *requestHeader(const RequestParser *parser, const char *buf, const char *name, size_t *len) {
+    size_t nameLen = strlen(name);
+    for (int i = 0; i < parser->headerCount; i++) {
+        if (parser->names[i].len == nameLen && strncasecmp(buf + parser->names[i].off, name, nameLen) == 0) {
+            *len = parser->values[i].len;
+            return buf + parser->values[i].off;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Take the current filter for reading, it is not freed until filterRelease.
+ * The reader counts itself under the parity of the epoch, and tries again if the epoch moved
+ * meanwhile: a swap that flipped it may have found no reader and freed the filter.
+ * @param ctx the server
+ * @param idx set to the parity to release
+ * @return the filter
+ */
+Filter *filterAcquire(serverCtx *ctx, int *idx) {
+    while (1) {
+        int epoch = __atomic_load_n(&ctx->filterEpoch, __ATOMIC_SEQ_CST);
+        *idx = epoch & 1;
+        __atomic_add_fetch(&ctx->filterReaders[*idx], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctx->filterEpoch, __ATOMIC_SEQ_CST) == epoch)
+            return __atomic_load_n(&ctx->filter, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&ctx->filterReaders[*idx], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+ * Done reading the filter.
+ * @param ctx the server
+ * @param idx the parity from filterAcquire
+ */
+void filterRelease(serverCtx *ctx, int idx) {
+    __atomic_sub_fetch(&ctx->filterReaders[idx], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Publish a new filter and free the old one once no reader can hold it.
+ * Readers that entered before the epoch flip may have the old filter, they are counted
+ * under the old parity, readers that enter after the flip can only load the new one.
+ * Only the reload thread swaps, so the flips don't race.
+ * @param ctx the server
+ * @param filter the new filter
+ */
+void filterSwap(serverCtx *ctx, Filter *filter) {
+    Filter *old = __atomic_exchange_n(&ctx->filter, filter, __ATOMIC_SEQ_CST);
+    int idx = __atomic_fetch_add(&ctx->filterEpoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&ctx->filterReaders[idx], __ATOMIC_SEQ_CST) != 0)
+        usleep(FILTER_DRAIN_US);
+    freeFilter(old);
+}
+
+/**
+ * Decide if a host may be served, the decision cache is asked first.
+ * A host blocked by name is answered without DNS, otherwise the host is resolved (without holding
+ * the filter, a reload doesn't wait for DNS) and its address is checked.
+ * @param ctx the server
+ * @param host the host
+ * @param addr set to the address of an allowed host
+ * @return DECISION_ALLOWED, DECISION_BLOCKED, DECISION_MISSING, -1 - the lookup failed
+ */
+int hostDecision(serverCtx *ctx, const char *host, struct in_addr *addr) {
+    int idx;
+    Filter *filter = filterAcquire(ctx, &idx);
+    unsigned long generation = filter->generation;
+    int verdict = decisionGet(ctx->decisions, host, generation, addr), byName = 0;
+    if (verdict == -1 && filter->unFilter == 0 && (host[0] < 48 || host[0] > 57))
+        byName = searchHost(filter->host, host);
+    filterRelease(ctx, idx);
+    if (byName) {
+        decisionPut(ctx->decisions, host, generation, DECISION_BLOCKED, *addr);
+        return DECISION_BLOCKED;
+    }
+    if (verdict != -1)
+        return verdict;
+    int checkResolve = resolveHost(ctx->dns, host, addr);
+    if (checkResolve == -1) /// Only a missing name is remembered.
+        return -1;
+    if (checkResolve == 1) {
+        decisionPut(ctx->decisions, host, generation, DECISION_MISSING, *addr);
+        return DECISION_MISSING;
+    }
+    filter = filterAcquire(ctx, &idx);
+    generation = filter->generation;
+    verdict = (filter->unFilter == 0 && searchAddressInFilter(filter->host, filter->ip, (char *) host, *addr) == 1)
+              ? DECISION_BLOCKED : DECISION_ALLOWED;
+    filterRelease(ctx, idx);
+    decisionPut(ctx->decisions, host, generation, verdict, *addr);
+    return verdict;
+}
+
+/**
+ * Make the host of a request canonical, in place: lower case and without a dot at the end,
+ * its port is taken off.
+ * @param host the host, with its port if it has one
+ * @param port set to the port, 80 if there is none
+ * @return 0 - success, -1 - no host or the port is not valid
+ */
+int canonicalHost(char *host, int *port) {
+    char *colon = strrchr(host, ':');
+    *port = 80;
+    if (colon != NULL) {
+        size_t digits = strlen(colon + 1);
+        if (digits > 5)
+            return -1;
+        for (size_t i = 0; i < digits; i++) {
+            if (!isdigit((u_char) colon[1 + i]))
+                return -1;
+        }
+        if (digits > 0) /// An empty port is the default one.
+            *port = (int) strtol(colon + 1, NULL, 10);
+        if (*port < 1 || *port > 65535)
+            return -1;
+        *colon = '\0';
+    }
+    size_t len = strlen(host);
+    for (size_t i = 0; i < len; i++)
+        host[i] = (char) tolower((u_char) host[i]);
+    while (len > 1 && host[len - 1] == '.')
+        host[--len] = '\0';
+    return (len == 0) ? -1 : 0;
+}
+
+/**
+ * Make the cache key of a request, the host followed by the path. Escapes of characters that
+ * don't need them are decoded and the others are in upper case, so equal URLs get one key.
+ * @param arena the arena of the request
+ * @param host the canonical host, with ":port" when the port isn't 80
+ * @param path the path of the request
+ * @return the key, NULL if failed
+ */
+char *canonicalKey(Arena *arena, const char *host, const char *path) {
+    size_t hostLen = strlen(host);
+    char *key = (char *) arenaAlloc(arena, hostLen + strlen(path) + 2), *out = key + hostLen;
+    if (key == NULL)
+        return NULL;
+    memcpy(key, host, hostLen);
+    if (*path != '/')
+        *out++ = '/';
+    for (const char *p = path; *p != '\0' && *p != '#'; p++) {
+        if (*p == '?' && !CACHE_KEY_QUERY)
+            break;
+        if (*p == '%' && isxdigit((u_char) p[1]) && isxdigit((u_char) p[2])) {
+            char hex[3] = {p[1], p[2], '\0'};
+            int c = (int) strtol(hex, NULL, 16);
+            if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') { /// Unreserved, the same as itself.
+                *out++ = (char) c;
+            } else {
+                *out++ = '%';
+                *out++ = (char) toupper((u_char) p[1]);
+                *out++ = (char) toupper((u_char) p[2]);
+            }
+            p += 2;
+            continue;
+        }
+        *out++ = *p;
+    }
+    *out = '\0';
+    return key;
+}
+
+/**
+ * Make the path of an object in the cache store, CACHE_DIR/ab/cd/abcd... by the hash of its key.
+ * @param arena the arena of the request
+ * @param hash the hash of the key
+ * @return the path, NULL if failed
+ */
+char *storePath(Arena *arena, unsigned long hash) {
+    char *path = (char *) arenaAlloc(arena, strlen(CACHE_DIR) + 24);
+    if (path == NULL)
+        return NULL;
+    sprintf(path, "%s/%02lx/%02lx/%016lx", CACHE_DIR, (hash >> 56) & 0xff, (hash >> 48) & 0xff, hash);
+    return path;
+}
+
+/**
+ * Request analysis to check if it is valid for sending.
+ * The request line and the headers come from the parser, only the parts needed are copied.
+ * @param req the request buffer, set to the request for the server
+ * @param parser the parser of the request, REQ_DONE
+ * @param clientSd the socket
+ * @param arena the arena of the request
+ * @param ctx the server (the filter and the resolver)
+ * @return struct URL, NULL if failed
+ */
+URL *parseRequest(char **req, RequestParser *parser, int clientSd, Arena *arena, serverCtx *ctx) {
+    URL *url;
+    url = (URL *) arenaAlloc(arena, sizeof(URL));
+    if (url == NULL) {
+        sendError(500, clientSd);
+        return NULL;
+    }
+    const char *buf = *req, *hostValue;
+    size_t hostLen = 0;
+    if (parser->state != REQ_DONE) {
+        sendError(400, clientSd);
+        return NULL;
+    }
+    const char *version = buf + parser->version.off;
+    int checkVersion = !(parser->version.len == 8 &&
+                         (strncmp(version, "HTTP/1.0", 8) == 0 || strncmp(version, "HTTP/1.1", 8) == 0));
+    hostValue = requestHeader(parser, buf, "host", &hostLen);
+    if (hostValue == NULL || hostLen == 0 || checkVersion == 1) {
+        sendError(400, clientSd);
+        return NULL;
+    }
+    if (parser->method.len != 3 || strncmp(buf + parser->method.off, "GET", 3) != 0) {
+        sendError(501, clientSd);
+        return NULL;
+    }
+    char *path = arenaStrndup(arena, buf + parser->path.off, parser->path.len);
+    char *protocol = arenaStrndup(arena, version, parser->version.len);
+    char *host = arenaStrndup(arena, hostValue, hostLen);
+    if (path == NULL || protocol == NULL || host == NULL) {
+        sendError(500, clientSd);
+        return NULL;
+    }
+    if (strncasecmp(path, "http://", 7) == 0) { /// The absolute form, its authority replaces the Host header.
+        char *slash = strchr(path + 7, '/');
+        host = arenaStrndup(arena, path + 7, (slash == NULL) ? strlen(path + 7) : (size_t) (slash - path - 7));
+        path = (slash == NULL) ? "/" : slash;
+        if (host == NULL) {
+            sendError(500, clientSd);
+            return NULL;
+        }
+    }
+    if (canonicalHost(host, &url->port) == -1) {
+        sendError(400, clientSd);
+        return NULL;
+    }
+    char *authority = host;
+    if (url->port != 80) {
+        if ((authority = (char *) arenaAlloc(arena, strlen(host) + 7)) == NULL) {
+            sendError(500, clientSd);
+            return NULL;
+        }
+        sprintf(authority, "%s:%d", host, url->port);
+    }
+    int verdict = hostDecision(ctx, host, &url->addr);
+    if (verdict == DECISION_BLOCKED) {
+        sendError(403, clientSd);
+        return NULL;
+    }
+    if (verdict != DECISION_ALLOWED) { /// Not found, or the lookup failed.
+        sendError(404, clientSd);
+        return NULL;
+    }
+    char *page = "index.html";
+    char *savePath = (char *) arenaAlloc(arena, strlen(path) + strlen(page) + 1);
+    if (savePath == NULL) {
+        sendError(500, clientSd);
+        return NULL;
+    }
+    strcpy(savePath, path);
+    if (savePath[strlen(savePath) - 1] == '/') {
+        strcat(savePath, page);
+    }
+    url->key = canonicalKey(arena, authority, path);
+    if (url->key == NULL || (url->fullPath = storePath(arena, url->keyHash = hashKey(url->key))) == NULL) {
+        sendError(500, clientSd);
+        return NULL;
+    }
+
+    char *tempReq = "GET  \r\nHOST: \r\nConnection: keep-alive\r\n\r\n";
+    *req = (char *) arenaAlloc(arena, strlen(tempReq) + strlen(path) + strlen(protocol) + strlen(authority) + 1);
+    if (*req == NULL) {
+        sendError(500, clientSd);
+        return NULL;
+    }
+    sprintf(*req, "GET %s %s\r\nHOST: %s\r\nConnection: keep-alive\r\n\r\n", path, protocol, authority);
+    url->hostName = host;
+    url->authority = authority;
+    url->path = savePath;
+    return url;
+}
+
+/**
+ * Create the directories of an object in the cache store, once for every directory.
+ * @param store the cache store
+ * @param hash the hash of the key
+ * @return 0 - success, -1 - failed
+ */
+int storeDirectory(CacheStore *store, unsigned long hash) {
+    unsigned int dir = (unsigned int) (hash >> 48) & 0xffff;
+    if (__atomic_load_n(&store->made[dir / 8], __ATOMIC_ACQUIRE) & (1u << (dir % 8)))
+        return 0;
+    char path[sizeof(CACHE_DIR) + 8];
+    sprintf(path, "%s/%02x", CACHE_DIR, dir >> 8);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    sprintf(path, "%s/%02x/%02x", CACHE_DIR, dir >> 8, dir & 0xff);
+    if (mkdir(path, 0700) == -1 && errno != EEXIST)
+        return -1;
+    __atomic_or_fetch(&store->made[dir / 8], (unsigned char) (1u << (dir % 8)), __ATOMIC_RELEASE);
+    return 0;
+}
+
+#ifdef USE_IO_URING
+typedef struct Uring { /// io_uring of one thread, built with the raw system calls
+    int fd;
+    unsigned entries, tail; /// tail - of the submissions prepared and not submitted yet
+    unsigned pending; /// submissions prepared and not completed
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqMap, *cqMap;
+    size_t sqMapLen, cqMapLen, sqesLen;
+} Uring;
+
+static pthread_key_t uringKey;
+static pthread_once_t uringOnce = PTHREAD_ONCE_INIT;
+static int uringDisabled; /// set once the kernel refused a ring, every thread uses the plain calls
+
+/**
+ * Free a ring, at the exit of its thread.
+ * @param arg the ring
+ */
+void uringFree(void *arg) {
+    Uring *ring = (Uring *) arg;
+    if (ring == NULL)
+        return;
+    close(ring->fd);
+    if (ring->sqes != NULL) munmap(ring->sqes, ring->sqesLen);
+    if (ring->cqMap != NULL && ring->cqMap != ring->sqMap) munmap(ring->cqMap, ring->cqMapLen);
+    if (ring->sqMap != NULL) munmap(ring->sqMap, ring->sqMapLen);
+    free(ring);
+}
+
+/**
+ * Create the key of the rings of the threads.
+ */
+void uringInit() {
+    pthread_key_create(&uringKey, uringFree);
+}
+
+/**
+ * Set up a ring: map its queues.
+ * @return the ring, NULL if the kernel doesn't give one
+ */
+Uring *uringCreate() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    Uring *ring = (Uring *) calloc(1, sizeof(Uring));
+    if (ring == NULL)
+        return NULL;
+    ring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+    ring->sqMapLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && ring->cqMapLen > ring->sqMapLen)
+        ring->sqMapLen = ring->cqMapLen;
+    ring->sqMap = mmap(NULL, ring->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                       IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        uringFree(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqMap = ring->sqMap;
+    else
+        ring->cqMap = mmap(NULL, ring->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                           IORING_OFF_CQ_RING);
+    ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->cqMap == MAP_FAILED) ring->cqMap = NULL;
+    if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+    if (ring->cqMap == NULL || ring->sqes == NULL) {
+        uringFree(ring);
+        return NULL;
+    }
+    char *sq = (char *) ring->sqMap, *cq = (char *) ring->cqMap;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->tail = *ring->sqTail;
+    return ring;
+}
+
+/**
+ * Get the ring of the calling thread, it is made at the first call.
+ * @return the ring, NULL - use the plain system calls
+ */
+Uring *uringThread() {
+    if (__atomic_load_n(&uringDisabled, __ATOMIC_RELAXED))
+        return NULL;
+    pthread_once(&uringOnce, uringInit);
+    Uring *ring = (Uring *) pthread_getspecific(uringKey);
+    if (ring == NULL) {
+        if ((ring = uringCreate()) == NULL) {
+            perror("io_uring: not available, using the plain system calls\n");
+            __atomic_store_n(&uringDisabled, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        pthread_setspecific(uringKey, ring);
+    }
+    return ring;
+}
+
+/**
+ * Prepare a submission, it goes to the kernel with the others at uringRun.
+ * @param ring the ring
+ * @param op the IORING_OP
+ * @param fd the file
+ * @param addr the buffer (or the path, or the address)
+ * @param len its length
+ * @param index the place of the result in the results of uringRun
+ * @return the submission, to set more fields
+ */
+struct io_uring_sqe *uringPrep(Uring *ring, int op, int fd, const void *addr, unsigned len, int index) {
+    unsigned slot = ring->tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (__u8) op;
+    sqe->fd = fd;
+    sqe->addr = (__u64) (uintptr_t) addr;
+    sqe->len = len;
+    sqe->user_data = (__u64) index;
+    ring->sqArray[slot] = slot;
+    ring->tail++;
+    ring->pending++;
+    return sqe;
+}
+
+/**
+ * Submit the prepared submissions in one system call and wait for their completions.
+ * A request prepares at most URING_ENTRIES submissions before it runs them.
+ * @param ring the ring
+ * @param results results[i] gets the result of the submission with index i, -errno on failure
+ * @return 0 - success, -1 - the ring failed after the submissions went in, -2 - the ring failed
+ * before any of them ran, they are taken back
+ */
+int uringRun(Uring *ring, int *results) {
+    unsigned submit = ring->tail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->tail, __ATOMIC_RELEASE);
+    while (ring->pending > 0) {
+        unsigned head = *ring->cqHead;
+        if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("error: io_uring_enter\n");
+                if (submit == 0)
+                    return -1;
+                __atomic_store_n(ring->sqTail, ring->tail - submit, __ATOMIC_RELEASE); /// The kernel took none.
+                ring->tail -= submit;
+                ring->pending -= submit;
+                return -2;
+            }
+            submit = 0;
+            continue;
+        }
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+        results[cqe->user_data] = cqe->res;
+        __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+        ring->pending--;
+    }
+    return 0;
+}
+
+/**
+ * Sync a file to the disk and close it, both in one system call.
+ * @param ring the ring
+ * @param fd the file
+ * @param sync 1 - fdatasync it first
+ * @return 0 - success, -1 - failed, -2 - the ring failed before the file was touched
+ */
+int uringSyncClose(Uring *ring, int fd, int sync) {
+    int results[2] = {0, 0};
+    if (sync) {
+        struct io_uring_sqe *sqe = uringPrep(ring, IORING_OP_FSYNC, fd, NULL, 0, 0);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = IOSQE_IO_HARDLINK; /// The close runs even when the sync fails.
+    }
+    uringPrep(ring, IORING_OP_CLOSE, fd, NULL, 0, 1);
+    int ran = uringRun(ring, results);
+    if (ran < 0)
+        return ran;
+    return (results[0] < 0 || results[1] < 0) ? -1 : 0;
+}
+#endif
+
+/**
+ * Sync a file to the disk and close it.
+ * @param fd the file
+ * @param sync 1 - fdatasync it first
+ * @return 0 - success, -1 - failed (the file is closed anyway)
+ */
+int syncClose(int fd, int sync) {
+#ifdef USE_IO_URING
+    Uring *ring = uringThread();
+    int closed = (ring != NULL) ? uringSyncClose(ring, fd, sync) : -2;
+    if (closed != -2) /// Otherwise the file is still open, the plain calls do it.
+        return closed;
+#endif
+    if (sync && fdatasync(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/**
+ * The Connection header that ends a response head.
+ * @param keepAlive 1 - the connection stays open
+ * @return the header line and the empty line
+ */
+const char *connectionLine(int keepAlive) {
+    return keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+/**
+ * Create the in-memory cache.
+ * @return the cache, NULL if failed
+ */
+HotCache *hotCreate() {
+    HotCache *hot = (HotCache *) calloc(1, sizeof(HotCache));
+    if (hot == NULL)
+        return NULL;
+    for (int i = 0; i < HOT_SHARDS; i++) {
+        if (pthread_mutex_init(&hot->shards[i].lock, NULL) != 0) {
+            free(hot);
+            return NULL;
+        }
+    }
+    return hot;
+}
+
+/**
+ * Free an object of the in-memory cache.
+ * @param obj the object
+ */
+void hotFreeObject(HotObject *obj) {
+    free(obj->key);
+    free(obj->data);
+    free(obj);
+}
+
+/**
+ * Free the in-memory cache.
+ * @param hot the cache
+ */
+void hotFree(HotCache *hot) {
+    if (hot == NULL)
+        return;
+    for (int i = 0; i < HOT_SHARDS; i++) {
+        HotObject *obj = hot->shards[i].head, *p;
+        while (obj != NULL) {
+            p = obj;
+            obj = obj->next;
+            hotFreeObject(p);
+        }
+        pthread_mutex_destroy(&hot->shards[i].lock);
+    }
+    free(hot);
+}
+
+/**
+ * Take an object out of the hash chain and the LRU list, under the shard lock.
+ * @param shard the shard
+ * @param obj the object
+ */
+void hotUnlink(HotShard *shard, HotObject *obj) {
+    HotObject **link = &shard->buckets[(obj->hash / HOT_SHARDS) % HOT_BUCKETS];
+    while (*link != obj)
+        link = &(*link)->hnext;
+    *link = obj->hnext;
+    if (obj->prev != NULL) obj->prev->next = obj->next;
+    else shard->head = obj->next;
+    if (obj->next != NULL) obj->next->prev = obj->prev;
+    else shard->tail = obj->prev;
+    shard->bytes -= obj->len;
+}
+
+/**
+ * Find an object and take a reference to it, a hit moves it to the front of the LRU list.
+ * @param hot the cache
+ * @param key the cache key
+ * @return the object, NULL if it is not in memory
+ */
+HotObject *hotGet(HotCache *hot, const char *key) {
+    unsigned long hash = hashKey(key);
+    HotShard *shard = &hot->shards[hash % HOT_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    HotObject *obj = shard->buckets[(hash / HOT_SHARDS) % HOT_BUCKETS];
+    while (obj != NULL && (obj->hash != hash || strcmp(obj->key, key) != 0))
+        obj = obj->hnext;
+    if (obj != NULL) {
+        if (obj != shard->head) {
+            obj->prev->next = obj->next;
+            if (obj->next != NULL) obj->next->prev = obj->prev;
+            else shard->tail = obj->prev;
+            obj->prev = NULL;
+            obj->next = shard->head;
+            shard->head->prev = obj;
+            shard->head = obj;
+        }
+        obj->refs++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return obj;
+}
+
+/**
+ * Drop a reference taken by hotGet or hotPut, an evicted object is freed by its last user.
+ * @param hot the cache
+ * @param obj the object
+ */
+void hotRelease(HotCache *hot, HotObject *obj) {
+    HotShard *shard = &hot->shards[obj->hash % HOT_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    int freeIt = (--obj->refs == 0 && obj->dead);
+    pthread_mutex_unlock(&shard->lock);
+    if (freeIt)
+        hotFreeObject(obj);
+}
+
+/**
+ * Insert an object, least recently used objects are evicted to keep the shard in its budget.
+ * If the key is already cached (another thread loaded it) the new object is dropped.
+ * @param hot the cache
+ * @param obj the object, with key, data and len set
+ * @return the cached object with a reference taken
+ */
+HotObject *hotPut(HotCache *hot, HotObject *obj) {
+    obj->hash = hashKey(obj->key);
+    HotShard *shard = &hot->shards[obj->hash % HOT_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    HotObject *old = shard->buckets[(obj->hash / HOT_SHARDS) % HOT_BUCKETS];
+    while (old != NULL && (old->hash != obj->hash || strcmp(old->key, obj->key) != 0))
+        old = old->hnext;
+    if (old != NULL && (old->freshUntil == 0 || old->freshUntil > time(NULL))) {
+        old->refs++;
+        pthread_mutex_unlock(&shard->lock);
+        hotFreeObject(obj);
+        return old;
+    }
+    if (old != NULL) { /// Stale, the new one takes its place.
+        hotUnlink(shard, old);
+        if (old->refs == 0)
+            hotFreeObject(old);
+        else
+            old->dead = 1;
+    }
+    while (shard->tail != NULL && shard->bytes + obj->len > HOT_CACHE_BUDGET / HOT_SHARDS) {
+        HotObject *victim = shard->tail;
+        hotUnlink(shard, victim);
+        if (victim->refs == 0)
+            hotFreeObject(victim);
+        else
+            victim->dead = 1;
+    }
+    obj->hnext = shard->buckets[(obj->hash / HOT_SHARDS) % HOT_BUCKETS];
+    shard->buckets[(obj->hash / HOT_SHARDS) % HOT_BUCKETS] = obj;
+    obj->prev = NULL;
+    obj->next = shard->head;
+    if (shard->head != NULL) shard->head->prev = obj;
+    else shard->tail = obj;
+    shard->head = obj;
+    shard->bytes += obj->len;
+    obj->refs = 1;
+    obj->dead = 0;
+    pthread_mutex_unlock(&shard->lock);
+    return obj;
+}
+
+/**
+ * Build the response header of a file from the local filesystem, without the Connection line.
+ * @param response buffer of LEN bytes
+ * @param fileLen the size of the file
+ * @param path the path of the request (for the content-type)
+ * @param stored the Content-Type the server sent, NULL or "" - guessed from the path
+ * @return length of the header
+ */
+size_t buildHeader(char *response, size_t fileLen, char *path, const char *stored) {
+    const char *type = (stored != NULL && stored[0] != '\0') ? stored : get_mime_type(path);
+    int len = sprintf(response, "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n", fileLen);
+    if (type != NULL)
+        len += sprintf(response + len, "Content-type: %s\r\n", type);
+    return len;
+}
+
+/**
+ * Read a small cached file into memory together with its header.
+ * @param hot the cache
+ * @param url URL struct
+ * @param fd the file
+ * @param fileLen its size
+ * @param freshUntil when the file gets stale, 0 - never
+ * @param type the stored Content-Type, NULL or "" - guessed from the path
+ * @return the cached object with a reference taken, NULL if failed
+ */
+HotObject *hotLoad(HotCache *hot, URL *url, int fd, size_t fileLen, time_t freshUntil, const char *type) {
+    char response[LEN];
+    size_t headerLen = buildHeader(response, fileLen, url->path, type), got = 0;
+    HotObject *obj = (HotObject *) calloc(1, sizeof(HotObject));
+    if (obj == NULL)
+        return NULL;
+    obj->key = strdup(url->fullPath);
+    obj->data = (char *) malloc(headerLen + fileLen);
+    if (obj->key == NULL || obj->data == NULL) {
+        hotFreeObject(obj);
+        return NULL;
+    }
+    memcpy(obj->data, response, headerLen);
+    while (got < fileLen) {
+        ssize_t checkRead = pread(fd, obj->data + headerLen + got, fileLen - got, (off_t) got);
+        if (checkRead < 0 && errno == EINTR)
+            continue;
+        if (checkRead <= 0) {
+            hotFreeObject(obj);
+            return NULL;
+        }
+        got += checkRead;
+    }
+    obj->len = headerLen + fileLen;
+    obj->headerLen = headerLen;
+    obj->freshUntil = freshUntil;
+    return hotPut(hot, obj);
+}
+
+/**
+ * Follow a chunked body to find where it ends, the data of the chunks can go to a file.
+ * @param chunks the state, zeroed before the first call
+ * @param buf bytes of the body
+ * @param len their number
+ * @param fileFd gets the data without the chunk framing, -1 - none. Set to -1 if a write of it failed
+ * @return bytes that belong to the body (len unless it ended inside buf), -1 - bad chunk
+ */
+ssize_t chunkScan(ChunkState *chunks, const char *buf, size_t len, int *fileFd) {
+    size_t i = 0;
+    while (i < len && chunks->state != CHUNK_DONE) {
+        char c = buf[i];
+        if (chunks->state == CHUNK_DATA) {
+            size_t take = (len - i < chunks->left) ? len - i : chunks->left;
+            if (*fileFd >= 0 && write(*fileFd, buf + i, take) != (ssize_t) take) /// The writer fell behind.
+                *fileFd = -1;
+            chunks->left -= take;
+            i += take;
+            if (chunks->left == 0)
+                chunks->state = CHUNK_DATA_END;
+            continue;
+        }
+        i++;
+        switch (chunks->state) {
+            case CHUNK_SIZE:
+                if (isxdigit((u_char) c)) {
+                    if (chunks->left > (SIZE_MAX >> 4))
+                        return -1;
+                    chunks->left = chunks->left * 16 + (isdigit((u_char) c) ? c - '0' : (tolower(c) - 'a' + 10));
+                    chunks->digits++;
+                } else if (c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                    chunks->state = CHUNK_SIZE_LINE;
+                } else if (c == '\n') {
+                    chunks->state = (chunks->left == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+                } else {
+                    return -1;
+                }
+                if (chunks->state != CHUNK_SIZE && chunks->digits == 0)
+                    return -1;
+                break;
+            case CHUNK_SIZE_LINE: /// Extensions until the end of the line.
+                if (c == '\n')
+                    chunks->state = (chunks->left == 0) ? CHUNK_TRAILER : CHUNK_DATA;
+                break;
+            case CHUNK_DATA_END: /// The CRLF after the data.
+                if (c == '\n') {
+                    chunks->state = CHUNK_SIZE;
+                    chunks->digits = 0;
+                } else if (c != '\r') {
+                    return -1;
+                }
+                break;
+            case CHUNK_TRAILER: /// Start of a trailer line, an empty one ends the body.
+                if (c == '\n')
+                    chunks->state = CHUNK_DONE;
+                else if (c != '\r')
+                    chunks->state = CHUNK_TRAILER_LINE;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n')
+                    chunks->state = CHUNK_TRAILER;
+                break;
+            default:
+                break;
+        }
+    }
+    return (ssize_t) i;
+}
+
+/**
+ * Give a connection back to its event loop, which goes on from its phase.
+ * @param args the connection
+ */
+void handBack(argThread *args) {
+    eventLoop *loop = args->loop;
+    uint64_t one = 1;
+    pthread_mutex_lock(&loop->inboxLock);
+    args->idleNext = loop->inbox;
+    loop->inbox = args;
+    pthread_mutex_unlock(&loop->inboxLock);
+    if (write(loop->wakeFd, &one, sizeof(one)) < 0)
+        perror("error: write eventfd\n");
+}
+
+/**
+ * Hand the connections parked in a flight back to their loops, called with the lock held.
+ * @param flight the flight
+ */
+void flightWake(Flight *flight) {
+    while (flight->waiters != NULL) {
+        argThread *args = flight->waiters;
+        flight->waiters = args->waitNext;
+        handBack(args);
+    }
+}
+
+/**
+ * Create the table of the fetches in progress.
+ * @return the table, NULL if failed
+ */
+FlightTable *flightCreate() {
+    FlightTable *flights = (FlightTable *) calloc(1, sizeof(FlightTable));
+    if (flights == NULL)
+        return NULL;
+    pthread_mutex_init(&flights->lock, NULL);
+    return flights;
+}
+
+/**
+ * Free the table, when no thread uses it anymore.
+ * @param flights the table
+ */
+void flightFree(FlightTable *flights) {
+    if (flights == NULL)
+        return;
+    pthread_mutex_destroy(&flights->lock);
+    free(flights);
+}
+
+/**
+ * Join the fetch of a file, or start one if nobody fetches it.
+ * @param flights the table
+ * @param key the path of the file
+ * @param leader set to 1 if the caller has to fetch it, 0 if it waits for another one
+ * @return the flight with a reference taken, NULL if failed
+ */
+Flight *flightJoin(FlightTable *flights, const char *key, int *leader) {
+    unsigned long hash = hashKey(key);
+    pthread_mutex_lock(&flights->lock);
+    Flight **bucket = &flights->buckets[hash % FLIGHT_BUCKETS], *flight = *bucket;
+    while (flight != NULL && (flight->hash != hash || strcmp(flight->key, key) != 0))
+        flight = flight->next;
+    if (flight != NULL) {
+        flight->refs++;
+        pthread_mutex_unlock(&flights->lock);
+        *leader = 0;
+        return flight;
+    }
+    flight = (Flight *) calloc(1, sizeof(Flight));
+    if (flight == NULL || (flight->key = strdup(key)) == NULL) {
+        pthread_mutex_unlock(&flights->lock);
+        free(flight);
+        return NULL;
+    }
+    flight->hash = hash;
+    flight->state = FLIGHT_PENDING;
+    flight->length = -1;
+    flight->refs = 1;
+    flight->table = flights;
+    flight->next = *bucket;
+    *bucket = flight;
+    pthread_mutex_unlock(&flights->lock);
+    *leader = 1;
+    return flight;
+}
+
+/**
+ * Change the state of a flight and wake its waiters, called with the lock held.
+ * A flight that ended leaves the table, so the next requests look at the cache again.
+ * @param flight the flight
+ * @param state the new state
+ */
+void flightSet(Flight *flight, int state) {
+    if (flight->state == FLIGHT_DONE || flight->state == FLIGHT_FAILED)
+        return;
+    flight->state = state;
+    if (state == FLIGHT_DONE || state == FLIGHT_FAILED) {
+        Flight **link = &flight->table->buckets[flight->hash % FLIGHT_BUCKETS];
+        while (*link != flight)
+            link = &(*link)->next;
+        *link = flight->next;
+    }
+    flightWake(flight);
+}
+
+/**
+ * Let the waiters stream the body from the temporary file as it is written.
+ * @param flight the flight, NULL - the fetch is not shared
+ * @param tempPath the temporary file
+ * @param length length of the body
+ * @param type the Content-Type of the response, "" - none
+ */
+void flightStream(Flight *flight, const char *tempPath, ssize_t length, const char *type) {
+    if (flight == NULL)
+        return;
+    char *path = strdup(tempPath);
+    if (path == NULL) /// The waiters will get the file when it is done.
+        return;
+    pthread_mutex_lock(&flight->table->lock);
+    flight->tempPath = path;
+    flight->length = length;
+    strcpy(flight->contentType, type);
+    flightSet(flight, FLIGHT_STREAMING);
+    pthread_mutex_unlock(&flight->table->lock);
+}
+
+/**
+ * Tell the waiters how much of the body is in the file.
+ * @param flight the flight, NULL - the fetch is not shared
+ * @param written bytes of the body in the file
+ */
+void flightProgress(Flight *flight, ssize_t written) {
+    if (flight == NULL)
+        return;
+    pthread_mutex_lock(&flight->table->lock);
+    flight->written = written;
+    flightWake(flight);
+    pthread_mutex_unlock(&flight->table->lock);
+}
+
+/**
+ * Rename the filled temporary file to its place in the cache.
+ * The waiters open the temporary file under the lock, so it is renamed under it too.
+ * @param flight the flight, NULL - the fetch is not shared
+ * @param tempPath the temporary file
+ * @param fullPath the path of the file in the cache
+ * @return 0 - success, -1 - failed
+ */
+int flightPublish(Flight *flight, const char *tempPath, const char *fullPath) {
+    if (flight == NULL)
+        return rename(tempPath, fullPath);
+    pthread_mutex_lock(&flight->table->lock);
+    int suc = rename(tempPath, fullPath);
+    flightSet(flight, (suc == 0) ? FLIGHT_DONE : FLIGHT_FAILED);
+    pthread_mutex_unlock(&flight->table->lock);
+    return suc;
+}
+
+/**
+ * End the flight if it didn't end yet.
+ * @param flight the flight, NULL - the fetch is not shared
+ * @param state FLIGHT_DONE or FLIGHT_FAILED
+ */
+void flightFinish(Flight *flight, int state) {
+    if (flight == NULL)
+        return;
+    pthread_mutex_lock(&flight->table->lock);
+    flightSet(flight, state);
+    pthread_mutex_unlock(&flight->table->lock);
+}
+
+/**
+ * Drop a reference to a flight, the last one frees it.
+ * @param flight the flight
+ */
+void flightLeave(Flight *flight) {
+    pthread_mutex_lock(&flight->table->lock);
+    int last = (--flight->refs == 0);
+    pthread_mutex_unlock(&flight->table->lock);
+    if (!last)
+        return;
+    free(flight->key);
+    free(flight->tempPath);
+    free(flight);
+}
+
+/**
+ * Create the pool of idle server connections.
+ * @return the pool, NULL if failed
+ */
+UpstreamPool *upstreamCreate() {
+    UpstreamPool *upstream = (UpstreamPool *) calloc(1, sizeof(UpstreamPool));
+    if (upstream == NULL)
+        return NULL;
+    if (pthread_mutex_init(&upstream->lock, NULL) != 0) {
+        free(upstream);
+        return NULL;
+    }
+    return upstream;
+}
+
+/**
+ * Close all the idle connections and free the pool.
+ * @param upstream the pool
+ */
+void upstreamFree(UpstreamPool *upstream) {
+    if (upstream == NULL)
+        return;
+    for (int i = 0; i < UPSTREAM_BUCKETS; i++) {
+        Origin *origin = upstream->buckets[i], *p;
+        while (origin != NULL) {
+            p = origin;
+            origin = origin->next;
+            for (int j = 0; j < p->count; j++)
+                close(p->fds[j]);
+            free(p->hostName);
+            free(p);
+        }
+    }
+    pthread_mutex_destroy(&upstream->lock);
+    free(upstream);
+}
+
+/**
+ * Find the origin of a host and port, under the pool lock.
+ * @param upstream the pool
+ * @param hostName the host, with ":port" when the port isn't 80
+ * @param create 1 - add it if it is missing
+ * @return the origin, NULL if not found
+ */
+Origin *upstreamOrigin(UpstreamPool *upstream, const char *hostName, int create) {
+    Origin **bucket = &upstream->buckets[hashKey(hostName) % UPSTREAM_BUCKETS], *origin = *bucket;
+    while (origin != NULL && strcmp(origin->hostName, hostName) != 0)
+        origin = origin->next;
+    if (origin == NULL && create) {
+        origin = (Origin *) calloc(1, sizeof(Origin));
+        if (origin == NULL)
+            return NULL;
+        origin->hostName = strdup(hostName);
+        if (origin->hostName == NULL) {
+            free(origin);
+            return NULL;
+        }
+        origin->next = *bucket;
+        *bucket = origin;
+    }
+    return origin;
+}
+
+/**
+ * Borrow an idle connection to the host.
+ * Connections idle for more than UPSTREAM_IDLE_TIMEOUT, or closed by the server, are dropped.
+ * @param upstream the pool
+ * @param hostName the host, with ":port" when the port isn't 80
+ * @return fd of socket, -1 if there is no idle connection
+ */
+int upstreamGet(UpstreamPool *upstream, const char *hostName) {
+    int fd = -1;
+    char peek;
+    time_t now = time(NULL);
+    pthread_mutex_lock(&upstream->lock);
+    Origin *origin = upstreamOrigin(upstream, hostName, 0);
+    while (origin != NULL && origin->count > 0 && fd == -1) {
+        origin->count--;
+        fd = origin->fds[origin->count];
+        if (now - origin->since[origin->count] > UPSTREAM_IDLE_TIMEOUT ||
+            recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            close(fd); /// Expired, closed by the server, or it sent something unexpected.
+            fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&upstream->lock);
+    return fd;
+}
+
+/**
+ * Return a connection whose response was fully read, it is closed if the origin is full.
+ * @param upstream the pool
+ * @param hostName the host, with ":port" when the port isn't 80
+ * @param fd the connection
+ */
+void upstreamPut(UpstreamPool *upstream, const char *hostName, int fd) {
+    pthread_mutex_lock(&upstream->lock);
+    Origin *origin = upstreamOrigin(upstream, hostName, 1);
+    if (origin != NULL && origin->count < UPSTREAM_MAX_IDLE) {
+        origin->fds[origin->count] = fd;
+        origin->since[origin->count] = time(NULL);
+        origin->count++;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&upstream->lock);
+    if (fd != -1)
+        close(fd);
+}
+
+/**
+ * Take the next item of a comma separated header value.
+ * @param p the position, moved after the item
+ * @param end the end of the value
+ * @param len set to the length of the item
+ * @return the item, NULL if there are no more
+ */
+const char *listNext(const char **p, const char *end, size_t *len) {
+    while (*p < end && (**p == ',' || **p == ' ' || **p == '\t'))
+        (*p)++;
+    if (*p == end)
+        return NULL;
+    const char *item = *p;
+    while (*p < end && **p != ',')
+        (*p)++;
+    const char *itemEnd = *p;
+    while (itemEnd > item && (itemEnd[-1] == ' ' || itemEnd[-1] == '\t'))
+        itemEnd--;
+    *len = itemEnd - item;
+    return item;
+}
+
+/**
+ * Check if an item is a given token.
+ * @param item the item
+ * @param len its length
+ * @param token the token, lower case
+ * @return 1 - it is, 0 - it isn't
+ */
+int isToken(const char *item, size_t len, const char *token) {
+    return len == strlen(token) && strncasecmp(item, token, len) == 0;
+}
+
+/**
+ * Take the values the proxy needs from one header of the response.
+ * @param res the response head
+ * @param buf the head buffer
+ * @param name the name of the header
+ * @param nameLen its length
+ * @param value its value, trimmed
+ * @param valueLen its length
+ * @return 0 - success, -1 - the header makes the response invalid
+ */
+int responseHeader(ResponseHead *res, const char *buf, const char *name, size_t nameLen, const char *value,
+                   size_t valueLen) {
+    const char *p = value, *end = value + valueLen, *item;
+    size_t len;
+    Span span = {(uint32_t) (value - buf), (uint32_t) valueLen};
+    if (isToken(name, nameLen, "content-length")) {
+        ssize_t length = 0;
+        if (valueLen == 0 || valueLen > 18)
+            return -1;
+        for (size_t i = 0; i < valueLen; i++) {
+            if (!isdigit((u_char) value[i]))
+                return -1;
+            length = length * 10 + (value[i] - '0');
+        }
+        if (res->contentLength != -1 && res->contentLength != length) /// Two lengths, no way to frame it.
+            return -1;
+        res->contentLength = length;
+    } else if (isToken(name, nameLen, "transfer-encoding")) {
+        while ((item = listNext(&p, end, &len)) != NULL) { /// Chunked only counts as the last coding.
+            res->otherCoding |= res->chunked;
+            res->chunked = isToken(item, len, "chunked");
+            if (!res->chunked)
+                res->otherCoding = 1;
+        }
+    } else if (isToken(name, nameLen, "connection")) {
+        while ((item = listNext(&p, end, &len)) != NULL) {
+            if (isToken(item, len, "close"))
+                res->close = 1;
+            else if (isToken(item, len, "keep-alive"))
+                res->keepAlive = 1;
+        }
+    } else if (isToken(name, nameLen, "cache-control")) {
+        while ((item = listNext(&p, end, &len)) != NULL) {
+            if (isToken(item, len, "no-store"))
+                res->noStore = 1;
+            else if (isToken(item, len, "no-cache") || (len > 9 && strncasecmp(item, "no-cache=", 9) == 0))
+                res->noCache = 1;
+            else if (isToken(item, len, "private") || (len > 8 && strncasecmp(item, "private=", 8) == 0))
+                res->isPrivate = 1;
+            else if (len > 8 && strncasecmp(item, "max-age=", 8) == 0 && res->maxAge == -1)
+                res->maxAge = strtol(item + 8, NULL, 10);
+            else if (len > 9 && strncasecmp(item, "s-maxage=", 9) == 0)
+                res->maxAge = strtol(item + 9, NULL, 10);
+        }
+    } else if (isToken(name, nameLen, "content-encoding")) {
+        res->encoded = !isToken(value, valueLen, "identity");
+    } else if (isToken(name, nameLen, "date")) {
+        res->date = span;
+    } else if (isToken(name, nameLen, "last-modified")) {
+        res->lastModified = span;
+    } else if (isToken(name, nameLen, "etag")) {
+        res->etag = span;
+    } else if (isToken(name, nameLen, "expires")) {
+        res->expires = span;
+    } else if (isToken(name, nameLen, "content-type")) {
+        res->contentType = span;
+    } else if (isToken(name, nameLen, "content-range")) {
+        res->contentRange = 1;
+    }
+    return 0;
+}
+
+/**
+ * Parse one line of the response head, without its CRLF.
+ * @param res the response head
+ * @param buf the head buffer
+ * @param start the offset of the line
+ * @param end the offset of its end
+ * @return 0 - more lines, 1 - the head ended, -1 - bad line
+ */
+int responseLine(ResponseHead *res, const char *buf, size_t start, size_t end) {
+    const char *line = buf + start;
+    size_t len = end - start;
+    if (res->state == REQ_LINE) { /// HTTP/1.x SSS reason
+        if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0 || !isdigit((u_char) line[7]) || line[8] != ' ' ||
+            !isdigit((u_char) line[9]) || !isdigit((u_char) line[10]) || !isdigit((u_char) line[11]) ||
+            (len > 12 && line[12] != ' '))
+            return -1;
+        res->minor = line[7] - '0';
+        res->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+        res->state = REQ_HEADERS;
+        return 0;
+    }
+    if (len == 0)
+        return 1;
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line || *line == ' ' || *line == '\t')
+        return -1;
+    const char *value = colon + 1, *valueEnd = buf + end;
+    while (value < valueEnd && (*value == ' ' || *value == '\t'))
+        value++;
+    while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+        valueEnd--;
+    return responseHeader(res, buf, line, colon - line, value, valueEnd - value);
+}
+
+/**
+ * Parse the bytes of the head that arrived since the last call.
+ * @param res the response head
+ * @param buf the head buffer
+ * @param len the bytes in it
+ * @return 1 - the head is complete (or bad, REQ_ERROR), 0 - wait for more
+ */
+int responseParse(ResponseHead *res, const char *buf, size_t len) {
+    while (res->state == REQ_LINE || res->state == REQ_HEADERS) {
+        const char *lf = findLF(buf + res->scanned, buf + len);
+        if (lf == NULL) {
+            res->scanned = len;
+            if (len >= MAX_HEAD_LEN) {
+                res->state = REQ_ERROR;
+                break;
+            }
+            return 0;
+        }
+        size_t end = lf - buf, lineEnd = end;
+        if (lineEnd > res->lineStart && buf[lineEnd - 1] == '\r')
+            lineEnd--;
+        int check = responseLine(res, buf, res->lineStart, lineEnd);
+        res->scanned = end + 1;
+        res->lineStart = end + 1;
+        if (check == -1) {
+            res->state = REQ_ERROR;
+        } else if (check == 1) {
+            res->state = REQ_DONE;
+            res->headLen = end + 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Find how the body of a response ends.
+ * @param res the response head
+ * @param reuse set to 0 if the server will close the connection
+ * @return length of the body, -1 - until the server closes or the chunks end (res->chunked)
+ */
+ssize_t bodyLength(ResponseHead *res, int *reuse) {
+    if (res->close || (res->minor == 0 && !res->keepAlive))
+        *reuse = 0;
+    if ((res->status >= 100 && res->status < 200) || res->status == 204 || res->status == 304)
+        return 0;
+    if (res->chunked && !res->otherCoding)
+        return -1;
+    if (res->chunked || res->otherCoding) { /// Ends by a coding we don't follow, only by the close.
+        res->chunked = 0;
+        *reuse = 0;
+        return -1;
+    }
+    if (res->contentLength >= 0)
+        return res->contentLength;
+    *reuse = 0;
+    return -1;
+}
+
+/**
+ * Check if a header line is about the connection itself, those are not forwarded.
+ * @param line start of the line
+ * @return 1 - hop-by-hop, 0 - otherwise
+ */
+int hopByHop(const char *line) {
+    return strncasecmp(line, "Connection:", 11) == 0 || strncasecmp(line, "Keep-Alive:", 11) == 0 ||
+           strncasecmp(line, "Proxy-Connection:", 17) == 0;
+}
+
+/**
+ * Copy the response head of the server with our own Connection header.
+ * @param head the head of the server
+ * @param headCount its length, including the empty line
+ * @param keepAlive 1 - the client connection stays open
+ * @param arena the arena of the request
+ * @param newLen length of the new head
+ * @return the new head, NULL if failed
+ */
+char *rewriteHead(const char *head, ssize_t headCount, int keepAlive, Arena *arena, size_t *newLen) {
+    const char *conn = connectionLine(keepAlive), *p = head, *end = head + headCount;
+    char *out = (char *) arenaAlloc(arena, headCount + strlen(conn) + 1);
+    if (out == NULL)
+        return NULL;
+    size_t len = 0;
+    int first = 1;
+    while (p < end) {
+        const char *lineEnd = memchr(p, '\n', end - p);
+        lineEnd = (lineEnd == NULL) ? end : lineEnd + 1;
+        if (*p == '\r' || *p == '\n') /// The empty line.
+            break;
+        if (first || !hopByHop(p)) {
+            memcpy(out + len, p, lineEnd - p);
+            len += lineEnd - p;
+        }
+        first = 0;
+        p = lineEnd;
+    }
+    strcpy(out + len, conn);
+    *newLen = len + strlen(conn);
+    return out;
+}
+
+/**
+ * Make the path of a hidden file next to a cached file, for its metadata or while it is filled.
+ * @param arena the arena of the request
+ * @param fullPath the path of the cached file
+ * @param suffix added to the name
+ * @return the path, NULL if failed
+ */
+char *hiddenPath(Arena *arena, const char *fullPath, const char *suffix) {
+    const char *slash = strrchr(fullPath, '/');
+    size_t dirLen = (slash == NULL) ? 0 : (size_t) (slash - fullPath + 1);
+    char *path = (char *) arenaAlloc(arena, strlen(fullPath) + strlen(suffix) + 2);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, fullPath, dirLen);
+    path[dirLen] = '.';
+    strcpy(path + dirLen + 1, fullPath + dirLen);
+    strcat(path, suffix);
+    return path;
+}
+
+/**
+ * Parse a date of a header, like "Sun, 06 Nov 1994 08:49:37 GMT".
+ * @param head the head buffer
+ * @param span the value of the header
+ * @return the time, -1 - no date or not valid
+ */
+time_t parseHttpDate(const char *head, Span span) {
+    char value[META_VALUE_LEN];
+    struct tm tm;
+    if (span.len == 0 || span.len >= sizeof(value))
+        return -1;
+    memcpy(value, head + span.off, span.len);
+    value[span.len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(value, "%a, %d %b %Y %H:%M:%S", &tm) == NULL)
+        return -1;
+    return timegm(&tm);
+}
+
+/**
+ * Copy a validator of the response into the metadata, a longer one is not kept.
+ * @param dst the field of the metadata
+ * @param head the head buffer
+ * @param span the value of the header
+ */
+void metaValue(char *dst, const char *head, Span span) {
+    if (span.len >= META_VALUE_LEN) {
+        dst[0] = '\0';
+        return;
+    }
+    memcpy(dst, head + span.off, span.len);
+    dst[span.len] = '\0';
+}
+
+/**
+ * Take the freshness information of a response into the metadata.
+ * A 304 only replaces what it carries, the rest stays from the stored response.
+ * @param meta the metadata, set by metaInit or read from the disk
+ * @param res the response head
+ * @param head the head buffer
+ */
+void metaUpdate(CacheMeta *meta, const ResponseHead *res, const char *head) {
+    time_t now = time(NULL), date = parseHttpDate(head, res->date);
+    meta->stored = now;
+    meta->date = (date == -1) ? now : date;
+    if (res->maxAge != -1)
+        meta->maxAge = res->maxAge;
+    if (res->noCache)
+        meta->noCache = 1;
+    if (res->expires.len > 0) { /// A date that isn't valid means already expired.
+        meta->expires = parseHttpDate(head, res->expires);
+        if (meta->expires == -1)
+            meta->expires = 0;
+    }
+    if (res->etag.len > 0)
+        metaValue(meta->etag, head, res->etag);
+    if (res->lastModified.len > 0) {
+        metaValue(meta->lastModified, head, res->lastModified);
+        meta->lastModifiedAt = parseHttpDate(head, res->lastModified);
+    }
+    if (res->contentType.len > 0)
+        metaValue(meta->contentType, head, res->contentType);
+}
+
+/**
+ * Start the metadata of a new response.
+ * @param meta the metadata
+ * @param status the status of the response
+ */
+void metaInit(CacheMeta *meta, int status) {
+    memset(meta, 0, sizeof(CacheMeta));
+    meta->magic = META_MAGIC;
+    meta->status = status;
+    meta->maxAge = -1;
+    meta->expires = -1;
+    meta->lastModifiedAt = -1;
+}
+
+/**
+ * Write the metadata of a cached file, into a temporary file that is renamed over the old one,
+ * so a reader never sees half of it.
+ * @param arena the arena of the request
+ * @param fullPath the path of the cached file
+ * @param meta the metadata
+ * @param key the cache key, kept after the metadata
+ * @return 0 - success, -1 - failed
+ */
+int writeMeta(Arena *arena, const char *fullPath, CacheMeta *meta, const char *key) {
+    char *path = hiddenPath(arena, fullPath, META_SUFFIX), *temp;
+    if (path == NULL || (temp = (char *) arenaAlloc(arena, strlen(path) + 8)) == NULL)
+        return -1;
+    sprintf(temp, "%s.XXXXXX", path);
+    int fd = mkstemp(temp);
+    if (fd < 0) {
+        perror("error: mkstemp\n");
+        return -1;
+    }
+    meta->keyLen = (unsigned int) strlen(key);
+    struct iovec iov[2] = {{meta, sizeof(CacheMeta)}, {(void *) key, meta->keyLen}};
+    if (writev(fd, iov, 2) != (ssize_t) (sizeof(CacheMeta) + meta->keyLen) || close(fd) == -1 ||
+        rename(temp, path) == -1) {
+        perror("error: write metadata\n");
+        close(fd);
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the metadata of a cached file.
+ * @param arena the arena of the request
+ * @param fullPath the path of the cached file
+ * @param meta filled with the metadata
+ * @param key set to the cache key of the file, in the arena
+ * @return 0 - success, -1 - the file has no metadata
+ */
+int readMeta(Arena *arena, const char *fullPath, CacheMeta *meta, char **key) {
+    char *path = hiddenPath(arena, fullPath, META_SUFFIX);
+    if (path == NULL)
+        return -1;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t got = read(fd, meta, sizeof(CacheMeta));
+    if (got != (ssize_t) sizeof(CacheMeta) || meta->magic != META_MAGIC || meta->keyLen > MAX_REQUEST_HEAD ||
+        (*key = (char *) arenaAlloc(arena, meta->keyLen + 1)) == NULL ||
+        read(fd, *key, meta->keyLen) != (ssize_t) meta->keyLen) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    (*key)[meta->keyLen] = '\0';
+    return 0;
+}
+
+/**
+ * Read the metadata of the cached object of a request.
+ * @param arena the arena of the request
+ * @param url URL struct
+ * @param meta filled with the metadata
+ * @return 0 - success, -1 - no metadata, or the file belongs to another key with the same hash
+ */
+int urlMeta(Arena *arena, URL *url, CacheMeta *meta) {
+    char *key;
+    if (readMeta(arena, url->fullPath, meta, &key) == -1)
+        return -1;
+    return (strcmp(key, url->key) == 0) ? 0 : -1;
+}
+
+/**
+ * Take an entry out of the LRU list of its shard, called with the lock held.
+ * @param shard the shard
+ * @param entry the entry
+ */
+void storeUnlinkLru(StoreShard *shard, StoreEntry *entry) {
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else shard->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else shard->tail = entry->prev;
+}
+
+/**
+ * Make an entry the most recently used of its shard, called with the lock held.
+ * @param store the cache store
+ * @param shard the shard
+ * @param entry the entry, already in the list if inList
+ * @param inList 1 - move it, 0 - insert it
+ */
+void storeTouch(CacheStore *store, StoreShard *shard, StoreEntry *entry, int inList) {
+    entry->lastUse = __atomic_add_fetch(&store->clock, 1, __ATOMIC_RELAXED);
+    if (inList) {
+        if (shard->head == entry)
+            return;
+        storeUnlinkLru(shard, entry);
+    }
+    entry->prev = NULL;
+    entry->next = shard->head;
+    if (shard->head != NULL) shard->head->prev = entry;
+    else shard->tail = entry;
+    shard->head = entry;
+}
+
+/**
+ * Find the counter of a key in a row of the sketch, by double hashing.
+ * @param hash the hash of the key
+ * @param row the row
+ * @return the index of the counter
+ */
+size_t sketchIndex(unsigned long hash, int row) {
+    unsigned long low = hash & 0xffffffff, high = (hash >> 32) | 1;
+    return (size_t) ((low + (unsigned long) row * high) % SKETCH_WIDTH);
+}
+
+/**
+ * Estimate how many times a key was requested lately, the smallest of its counters.
+ * @param store the cache store
+ * @param hash the hash of the key
+ * @return the estimate
+ */
+int sketchEstimate(CacheStore *store, unsigned long hash) {
+    int min = SKETCH_COUNTER_MAX;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int count = __atomic_load_n(&store->sketch[row][sketchIndex(hash, row)], __ATOMIC_RELAXED);
+        if (count < min)
+            min = count;
+    }
+    return min;
+}
+
+/**
+ * Count a request of a key. Only the smallest counters grow (conservative update), and once
+ * SKETCH_AGING requests were counted all the counters are halved, so old popularity fades.
+ * Threads count without a lock, a lost increment only makes the estimate a bit lower.
+ * @param store the cache store
+ * @param hash the hash of the key
+ */
+void sketchAdd(CacheStore *store, unsigned long hash) {
+    int min = sketchEstimate(store, hash);
+    if (min < SKETCH_COUNTER_MAX) {
+        for (int row = 0; row < SKETCH_DEPTH; row++) {
+            unsigned char *counter = &store->sketch[row][sketchIndex(hash, row)];
+            if (__atomic_load_n(counter, __ATOMIC_RELAXED) == min)
+                __atomic_store_n(counter, (unsigned char) (min + 1), __ATOMIC_RELAXED);
+        }
+    }
+    if (__atomic_add_fetch(&store->sketchAdds, 1, __ATOMIC_RELAXED) % SKETCH_AGING != 0)
+        return;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        for (size_t i = 0; i < SKETCH_WIDTH; i++) {
+            unsigned char count = __atomic_load_n(&store->sketch[row][i], __ATOMIC_RELAXED);
+            __atomic_store_n(&store->sketch[row][i], (unsigned char) (count / 2), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * Check if the cache store is over a part of its budget.
+ * @param store the cache store
+ * @param percent the part of the budget
+ * @return 1 - over it, 0 - not
+ */
+int storeOver(CacheStore *store, long percent) {
+    return __atomic_load_n(&store->bytes, __ATOMIC_RELAXED) > CACHE_MAX_BYTES / 100 * percent ||
+           __atomic_load_n(&store->inodes, __ATOMIC_RELAXED) > CACHE_MAX_INODES / 100 * percent;
+}
+
+/**
+ * Decide if a response is stored or only relayed to the client (TinyLFU). A URL must be asked
+ * CACHE_ADMIT_MIN times first, so one time requests don't take disk writes and room. Once the
+ * store is near its budget, a new object must also be asked more than the object it would push
+ * out, the least recently used of its shard.
+ * @param store the cache store
+ * @param hash the hash of the key
+ * @param bodyLen length of the body, -1 - not known yet
+ * @return 1 - store it, 0 - only relay it
+ */
+int storeAdmit(CacheStore *store, unsigned long hash, ssize_t bodyLen) {
+    if (bodyLen > CACHE_OBJECT_MAX)
+        return 0;
+    int freq = sketchEstimate(store, hash);
+    if (freq < CACHE_ADMIT_MIN)
+        return 0;
+    if (!storeOver(store, CACHE_LOW_PERCENT))
+        return 1;
+    StoreShard *shard = &store->shards[hash % STORE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    unsigned long victim = (shard->tail != NULL) ? shard->tail->hash : 0;
+    int hasVictim = (shard->tail != NULL && victim != hash);
+    pthread_mutex_unlock(&shard->lock);
+    return !hasVictim || freq > sketchEstimate(store, victim);
+}
+
+/**
+ * Find an object in the index of the cache store, so a miss doesn't touch the disk.
+ * @param store the cache store
+ * @param url URL struct
+ * @return 1 - the object is stored, 0 - not
+ */
+int storeLookup(CacheStore *store, URL *url) {
+    StoreShard *shard = &store->shards[url->keyHash % STORE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    StoreEntry *entry = shard->buckets[(url->keyHash / STORE_SHARDS) % STORE_BUCKETS];
+    while (entry != NULL && entry->hash != url->keyHash)
+        entry = entry->hnext;
+    int found = (entry != NULL && strcmp(entry->key, url->key) == 0);
+    if (found)
+        storeTouch(store, shard, entry, 1);
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+/**
+ * Add an object to the index under the lock of its shard, it takes the place of any object in
+ * the same file.
+ * @param store the cache store
+ * @param shard the shard of the hash, locked
+ * @param copy the cache key, malloc'ed, it goes to the index (freed if failed)
+ * @param hash its hash
+ * @param size the size of the file
+ * @return 0 - success, -1 - failed
+ */
+int storeIndex(CacheStore *store, StoreShard *shard, char *copy, unsigned long hash, off_t size) {
+    StoreEntry **bucket = &shard->buckets[(hash / STORE_SHARDS) % STORE_BUCKETS], *entry = *bucket;
+    while (entry != NULL && entry->hash != hash)
+        entry = entry->hnext;
+    int inList = (entry != NULL);
+    if (entry == NULL) {
+        entry = (StoreEntry *) calloc(1, sizeof(StoreEntry));
+        if (entry == NULL) {
+            free(copy);
+            return -1;
+        }
+        entry->hash = hash;
+        entry->hnext = *bucket;
+        *bucket = entry;
+        __atomic_add_fetch(&store->inodes, 2, __ATOMIC_RELAXED);
+    }
+    free(entry->key);
+    entry->key = copy;
+    __atomic_add_fetch(&store->bytes, (long) (size - entry->size), __ATOMIC_RELAXED);
+    entry->size = size;
+    storeTouch(store, shard, entry, inList);
+    return 0;
+}
+
+/**
+ * Add an object to the index, it takes the place of any object in the same file.
+ * @param store the cache store
+ * @param key the cache key
+ * @param hash its hash
+ * @param size the size of the file
+ * @return 0 - success, -1 - failed
+ */
+int storeAdd(CacheStore *store, const char *key, unsigned long hash, off_t size) {
+    StoreShard *shard = &store->shards[hash % STORE_SHARDS];
+    char *copy = strdup(key);
+    if (copy == NULL)
+        return -1;
+    pthread_mutex_lock(&shard->lock);
+    int suc = storeIndex(store, shard, copy, hash, size);
+    pthread_mutex_unlock(&shard->lock);
+    if (storeOver(store, 100)) /// Wake the evictor now, not at its next check.
+        pthread_cond_signal(&store->evictWake);
+    return suc;
+}
+
+/**
+ * Put a whole fill in its place: its metadata is written, the file renamed and added to the
+ * index. The shard lock is held across all three, so the evictor can't remove the files of an
+ * older object of the key in between, and the index never has a file that isn't in place.
+ * @param store the cache store
+ * @param fill the fill, its temporary file is left if the rename fails
+ * @param arena for the paths of the metadata
+ * @return 0 - success, -1 - failed (the flight of the fill is ended)
+ */
+int storePublish(CacheStore *store, Fill *fill, Arena *arena) {
+    StoreShard *shard = &store->shards[fill->hash % STORE_SHARDS];
+    char *copy = strdup(fill->key);
+    if (copy == NULL) {
+        flightFinish(fill->flight, FLIGHT_FAILED);
+        return -1;
+    }
+    pthread_mutex_lock(&shard->lock);
+    writeMeta(arena, fill->fullPath, &fill->meta, fill->key); /// First, a file without it would be fresh forever.
+    if (flightPublish(fill->flight, fill->tempPath, fill->fullPath) == -1) {
+        pthread_mutex_unlock(&shard->lock);
+        free(copy);
+        return -1;
+    }
+    int suc = storeIndex(store, shard, copy, fill->hash, fill->written);
+    if (suc == -1) /// A file that isn't indexed would never be evicted.
+        unlink(fill->fullPath);
+    pthread_mutex_unlock(&shard->lock);
+    if (storeOver(store, 100))
+        pthread_cond_signal(&store->evictWake);
+    return suc;
+}
+
+/**
+ * Remove the object of a file from the index.
+ * @param store the cache store
+ * @param hash the hash of the key
+ */
+void storeRemove(CacheStore *store, unsigned long hash) {
+    StoreShard *shard = &store->shards[hash % STORE_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    StoreEntry **link = &shard->buckets[(hash / STORE_SHARDS) % STORE_BUCKETS], *entry;
+    while (*link != NULL && (*link)->hash != hash)
+        link = &(*link)->hnext;
+    if ((entry = *link) != NULL) {
+        *link = entry->hnext;
+        storeUnlinkLru(shard, entry);
+        __atomic_sub_fetch(&store->bytes, (long) entry->size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&store->inodes, 2, __ATOMIC_RELAXED);
+        free(entry->key);
+        free(entry);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Evict the least recently used object of the store: the oldest of the tails of the shards.
+ * Its files are removed under the lock of the shard, so a fill of the same file that comes
+ * after it is not removed with them.
+ * @param store the cache store
+ * @return 0 - an object was evicted, -1 - the store is empty
+ */
+int storeEvictOne(CacheStore *store) {
+    StoreShard *oldest = NULL;
+    unsigned long oldestUse = 0;
+    for (int i = 0; i < STORE_SHARDS; i++) {
+        StoreShard *shard = &store->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (shard->tail != NULL && (oldest == NULL || shard->tail->lastUse < oldestUse)) {
+            oldest = shard;
+            oldestUse = shard->tail->lastUse;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    if (oldest == NULL)
+        return -1;
+    char path[sizeof(CACHE_DIR) + 32];
+    pthread_mutex_lock(&oldest->lock);
+    StoreEntry *entry = oldest->tail, **link;
+    if (entry != NULL) { /// Not the one that was seen if it was hit meanwhile, close enough.
+        link = &oldest->buckets[(entry->hash / STORE_SHARDS) % STORE_BUCKETS];
+        while (*link != entry)
+            link = &(*link)->hnext;
+        *link = entry->hnext;
+        storeUnlinkLru(oldest, entry);
+        __atomic_sub_fetch(&store->bytes, (long) entry->size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&store->inodes, 2, __ATOMIC_RELAXED);
+        unsigned long hash = entry->hash;
+        sprintf(path, "%s/%02lx/%02lx/%016lx", CACHE_DIR, (hash >> 56) & 0xff, (hash >> 48) & 0xff, hash);
+        unlink(path);
+        sprintf(path, "%s/%02lx/%02lx/.%016lx%s", CACHE_DIR, (hash >> 56) & 0xff, (hash >> 48) & 0xff, hash,
+                META_SUFFIX);
+        unlink(path);
+        free(entry->key);
+        free(entry);
+    }
+    pthread_mutex_unlock(&oldest->lock);
+    return 0;
+}
+
+/**
+ * The evictor thread, keeps the cache store in its budget of bytes and files.
+ * Once over the budget it evicts the least recently used objects until the store is under
+ * CACHE_LOW_PERCENT of it, so it doesn't run again at the next fill.
+ * @param arg the cache store
+ * @return NULL
+ */
+void *storeEvict(void *arg) {
+    CacheStore *store = (CacheStore *) arg;
+    pthread_mutex_lock(&store->evictLock);
+    while (!store->stopping) {
+        if (!storeOver(store, 100)) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += EVICT_INTERVAL;
+            pthread_cond_timedwait(&store->evictWake, &store->evictLock, &until);
+            continue;
+        }
+        pthread_mutex_unlock(&store->evictLock);
+        int evicted = 0;
+        while (storeOver(store, CACHE_LOW_PERCENT) && storeEvictOne(store) == 0)
+            evicted++;
+        printf("Cache store: %d objects evicted\n", evicted);
+        pthread_mutex_lock(&store->evictLock);
+    }
+    pthread_mutex_unlock(&store->evictLock);
+    return NULL;
+}
+
+/**
+ * Index the objects of one directory of the cache store, by their metadata.
+ * Temporary files left by a fill that never ended are removed.
+ * @param store the cache store
+ * @param dirPath the directory
+ * @param arena for the paths and the keys
+ */
+void storeScanDir(CacheStore *store, const char *dirPath, Arena *arena) {
+    DIR *dir = opendir(dirPath);
+    struct dirent *ent;
+    if (dir == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        char *path = (char *) arenaAlloc(arena, strlen(dirPath) + len + 2), *key;
+        if (path == NULL)
+            break;
+        sprintf(path, "%s/%s", dirPath, ent->d_name);
+        if (ent->d_name[0] != '.' || strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+        if (len != 1 + 16 + strlen(META_SUFFIX) || strcmp(ent->d_name + 17, META_SUFFIX) != 0) {
+            unlink(path);
+            continue;
+        }
+        CacheMeta meta;
+        struct stat st;
+        sprintf(path, "%s/%.16s", dirPath, ent->d_name + 1);
+        unsigned long hash = strtoul(ent->d_name + 1, NULL, 16);
+        if (readMeta(arena, path, &meta, &key) == 0 && hashKey(key) == hash && stat(path, &st) == 0) {
+            storeAdd(store, key, hash, st.st_size);
+            continue;
+        }
+        unlink(path); /// Its metadata is of an older layout or another key, it can't be served.
+        sprintf(path, "%s/%s", dirPath, ent->d_name);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+/**
+ * Create the cache store and index the objects it already has.
+ * @return the store, NULL if failed
+ */
+CacheStore *storeCreate() {
+    CacheStore *store = (CacheStore *) calloc(1, sizeof(CacheStore));
+    if (store == NULL)
+        return NULL;
+    for (int i = 0; i < STORE_SHARDS; i++)
+        pthread_mutex_init(&store->shards[i].lock, NULL);
+    pthread_mutex_init(&store->evictLock, NULL);
+    pthread_cond_init(&store->evictWake, NULL);
+    if (mkdir(CACHE_DIR, 0700) == -1 && errno != EEXIST) {
+        perror("error: mkdir cache\n");
+        free(store);
+        return NULL;
+    }
+    Arena arena;
+    memset(&arena, 0, sizeof(arena));
+    char path[sizeof(CACHE_DIR) + 8];
+    struct stat st;
+    for (unsigned int first = 0; first < 256; first++) {
+        sprintf(path, "%s/%02x", CACHE_DIR, first);
+        if (stat(path, &st) == -1)
+            continue;
+        for (unsigned int dir = first << 8; dir < (first + 1) << 8; dir++) {
+            sprintf(path, "%s/%02x/%02x", CACHE_DIR, first, dir & 0xff);
+            if (stat(path, &st) == -1)
+                continue;
+            store->made[dir / 8] |= (unsigned char) (1u << (dir % 8));
+            storeScanDir(store, path, &arena);
+            arenaReset(&arena);
+        }
+    }
+    arenaFree(&arena);
+    if (pthread_create(&store->evictThread, NULL, storeEvict, store) == 0)
+        store->evicting = 1;
+    else
+        perror("pthread_create: the cache store has no budget.\n");
+    return store;
+}
+
+/**
+ * Stop the evictor and free the index of the cache store, the files stay.
+ * @param store the cache store
+ */
+void storeFree(CacheStore *store) {
+    if (store == NULL)
+        return;
+    if (store->evicting) {
+        pthread_mutex_lock(&store->evictLock);
+        store->stopping = 1;
+        pthread_cond_signal(&store->evictWake);
+        pthread_mutex_unlock(&store->evictLock);
+        pthread_join(store->evictThread, NULL);
+    }
+    pthread_mutex_destroy(&store->evictLock);
+    pthread_cond_destroy(&store->evictWake);
+    for (int i = 0; i < STORE_SHARDS; i++) {
+        for (int j = 0; j < STORE_BUCKETS; j++) {
+            StoreEntry *entry = store->shards[i].buckets[j], *next;
+            while (entry != NULL) {
+                next = entry->hnext;
+                free(entry->key);
+                free(entry);
+                entry = next;
+            }
+        }
+        pthread_mutex_destroy(&store->shards[i].lock);
+    }
+    free(store);
+}
+
+#ifdef USE_IO_URING
+/**
+ * Open a cached file and read its metadata on the ring: both files are opened in one system
+ * call, the metadata is read and its file closed in the next.
+ * @param ring the ring
+ * @param arena the arena of the request
+ * @param url URL struct
+ * @param meta filled with the metadata
+ * @return the file, -1 if it is not there or belongs to another key with the same hash
+ */
+int uringOpen(Uring *ring, Arena *arena, URL *url, CacheMeta *meta) {
+    size_t keyLen = strlen(url->key);
+    char *path = hiddenPath(arena, url->fullPath, META_SUFFIX), *key = (char *) arenaAlloc(arena, keyLen + 1);
+    int results[2] = {-1, -1};
+    if (path == NULL || key == NULL)
+        return -1;
+    uringPrep(ring, IORING_OP_OPENAT, AT_FDCWD, url->fullPath, 0, 0)->open_flags = O_RDONLY;
+    uringPrep(ring, IORING_OP_OPENAT, AT_FDCWD, path, 0, 1)->open_flags = O_RDONLY;
+    if (uringRun(ring, results) < 0 || results[0] < 0 || results[1] < 0) {
+        if (results[0] >= 0) close(results[0]);
+        if (results[1] >= 0) close(results[1]);
+        return -1;
+    }
+    int fd = results[0], metaFd = results[1];
+    struct iovec iov[2] = {{meta, sizeof(CacheMeta)}, {key, keyLen + 1}}; /// One more byte finds a longer key.
+    struct io_uring_sqe *sqe = uringPrep(ring, IORING_OP_READV, metaFd, iov, 2, 0);
+    sqe->flags = IOSQE_IO_HARDLINK; /// The close runs even after a short read.
+    uringPrep(ring, IORING_OP_CLOSE, metaFd, NULL, 0, 1);
+    int ran = uringRun(ring, results);
+    if (ran < 0) {
+        if (ran == -2)
+            close(metaFd);
+        close(fd);
+        return -1;
+    }
+    if (results[0] != (int) (sizeof(CacheMeta) + keyLen) || meta->magic != META_MAGIC || meta->keyLen != keyLen ||
+        memcmp(key, url->key, keyLen) != 0) { /// Another key with the same hash took the file.
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+/**
+ * Open the file of a request in the cache store, the index is asked first so a miss doesn't
+ * touch the disk.
+ * @param store the cache store
+ * @param arena the arena of the request
+ * @param url URL struct
+ * @param meta filled with the metadata of the file
+ * @return the file, -1 - not in the store
+ */
+int storeOpen(CacheStore *store, Arena *arena, URL *url, CacheMeta *meta) {
+    if (!storeLookup(store, url))
+        return -1;
+#ifdef USE_IO_URING
+    Uring *ring = uringThread();
+    if (ring != NULL)
+        return uringOpen(ring, arena, url, meta);
+#endif
+    int fd = open(url->fullPath, O_RDONLY);
+    if (fd >= 0 && urlMeta(arena, url, meta) == -1) { /// Another key with the same hash took the file.
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Remove a cached file and its metadata.
+ * @param store the cache store
+ * @param arena the arena of the request
+ * @param url URL struct
+ */
+void removeCached(CacheStore *store, Arena *arena, URL *url) {
+    char *path = hiddenPath(arena, url->fullPath, META_SUFFIX);
+    storeRemove(store, url->keyHash);
+    unlink(url->fullPath);
+    if (path != NULL)
+        unlink(path);
+}
+
+/**
+ * Find until when a cached response is fresh: max-age, else Expires, else a tenth of the
+ * time since Last-Modified, else CACHE_DEFAULT_TTL.
+ * @param meta the metadata
+ * @return the time it gets stale, never 0
+ */
+time_t metaFreshUntil(const CacheMeta *meta) {
+    long lifetime;
+    if (meta->noCache) /// Must be revalidated before every use.
+        lifetime = 0;
+    else if (meta->maxAge >= 0)
+        lifetime = meta->maxAge;
+    else if (meta->expires != -1)
+        lifetime = (long) (meta->expires - meta->date);
+    else if (meta->lastModifiedAt != -1 && meta->date > meta->lastModifiedAt)
+        lifetime = (long) ((meta->date - meta->lastModifiedAt) / 10);
+    else
+        lifetime = CACHE_DEFAULT_TTL;
+    if (lifetime > CACHE_HEURISTIC_MAX && meta->maxAge < 0 && meta->expires == -1)
+        lifetime = CACHE_HEURISTIC_MAX;
+    if (lifetime < 0)
+        lifetime = 0;
+    return meta->stored + lifetime;
+}
+
+/**
+ * Make the request conditional on the validators of the cached file, so the server answers
+ * 304 without the body if it didn't change.
+ * @param arena the arena of the request
+ * @param req the request, ends with an empty line
+ * @param meta the metadata of the cached file
+ * @return the new request, NULL if failed
+ */
+char *conditionalRequest(Arena *arena, const char *req, const CacheMeta *meta) {
+    size_t len = strlen(req), used = len - 2; /// Without the empty line.
+    char *out = (char *) arenaAlloc(arena, len + 2 * META_VALUE_LEN + 48);
+    if (out == NULL)
+        return NULL;
+    memcpy(out, req, used);
+    if (meta->etag[0] != '\0')
+        used += sprintf(out + used, "If-None-Match: %s\r\n", meta->etag);
+    if (meta->lastModified[0] != '\0')
+        used += sprintf(out + used, "If-Modified-Since: %s\r\n", meta->lastModified);
+    strcpy(out + used, "\r\n");
+    return out;
+}
+
+/**
+ * Publish a drained fill, on the publisher thread: a whole file is synced, its metadata
+ * written and it is renamed to its place, a dropped one is removed.
+ * @param writer the cache writer
+ * @param fill the fill, freed
+ */
+void fillFinish(CacheWriter *writer, Fill *fill) {
+    int dropped = __atomic_load_n(&fill->dropped, __ATOMIC_ACQUIRE);
+    if (syncClose(fill->fileFd, !dropped) == -1)
+        dropped = 1;
+    if (dropped) {
+        unlink(fill->tempPath);
+        if (__atomic_load_n(&fill->replaces, __ATOMIC_ACQUIRE)) { /// The stale file is not good anymore.
+            char *path = hiddenPath(&writer->arena, fill->fullPath, META_SUFFIX);
+            storeRemove(writer->store, fill->hash);
+            unlink(fill->fullPath);
+            if (path != NULL)
+                unlink(path);
+        }
+        flightFinish(fill->flight, FLIGHT_FAILED);
+    } else if (storePublish(writer->store, fill, &writer->arena) == -1) {
+        perror("error: publish the fill\n");
+        unlink(fill->tempPath);
+    }
+    if (fill->flight != NULL)
+        flightLeave(fill->flight);
+    arenaReset(&writer->arena);
+    free(fill->tempPath);
+    free(fill->fullPath);
+    free(fill->key);
+    free(fill);
+    __atomic_sub_fetch(&writer->active, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Hand a drained fill to the publisher, so the writer goes on draining the other pipes
+ * while it is synced.
+ * @param writer the cache writer
+ * @param fill the fill
+ * @param failed 1 - writing the file failed
+ */
+void fillDrained(CacheWriter *writer, Fill *fill, int failed) {
+    epoll_ctl(writer->epfd, EPOLL_CTL_DEL, fill->pipeFd, NULL);
+    close(fill->pipeFd);
+    if (failed)
+        __atomic_store_n(&fill->dropped, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&writer->doneLock);
+    fill->next = writer->done;
+    writer->done = fill;
+    pthread_cond_signal(&writer->doneWake);
+    pthread_mutex_unlock(&writer->doneLock);
+}
+
+/**
+ * The publisher thread, publishes the drained fills in batches, each whole file is synced
+ * with its own fdatasync so a busy file system doesn't hold it up.
+ * @param arg the cache writer
+ * @return NULL
+ */
+void *publishWork(void *arg) {
+    CacheWriter *writer = (CacheWriter *) arg;
+    while (1) {
+        pthread_mutex_lock(&writer->doneLock);
+        while (writer->done == NULL && !writer->stopping)
+            pthread_cond_wait(&writer->doneWake, &writer->doneLock);
+        Fill *batch = writer->done;
+        writer->done = NULL;
+        pthread_mutex_unlock(&writer->doneLock);
+        if (batch == NULL)
+            return NULL;
+        while (batch != NULL) {
+            Fill *next = batch->next;
+            fillFinish(writer, batch);
+            batch = next;
+        }
+    }
+}
+
+/**
+ * Move what the relay put in the pipe of a fill to its file, all of it in one splice.
+ * @param writer the cache writer
+ * @param fill the fill
+ */
+void fillWork(CacheWriter *writer, Fill *fill) {
+    while (1) {
+        ssize_t moved = splice(fill->pipeFd, NULL, fill->fileFd, NULL, WRITER_PIPE_SIZE,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            fill->written += moved;
+            flightProgress(fill->flight, fill->written);
+            continue;
+        }
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && errno == EAGAIN) /// The relay puts more later.
+            return;
+        fillDrained(writer, fill, moved < 0);
+        return;
+    }
+}
+
+/**
+ * The cache writer thread, writes the fills to the disk off the relay of the clients.
+ * Once stopped it ends when the fills it has are finished.
+ * @param arg the cache writer
+ * @return NULL
+ */
+void *writerWork(void *arg) {
+    CacheWriter *writer = (CacheWriter *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    int stopping = 0;
+    while (!stopping || __atomic_load_n(&writer->active, __ATOMIC_SEQ_CST) > 0) {
+        int count = epoll_wait(writer->epfd, events, MAX_EVENTS, stopping ? 100 : -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: epoll_wait\n");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t value;
+                if (read(writer->stopFd, &value, sizeof(value)) < 0)
+                    perror("error: read eventfd\n");
+                stopping = 1;
+                continue;
+            }
+            fillWork(writer, (Fill *) events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Create the cache writer and start its thread.
+ * @param store the cache store
+ * @return the writer, NULL if failed
+ */
+CacheWriter *writerCreate(CacheStore *store) {
+    CacheWriter *writer = (CacheWriter *) calloc(1, sizeof(CacheWriter));
+    if (writer == NULL)
+        return NULL;
+    writer->store = store;
+    writer->epfd = epoll_create1(EPOLL_CLOEXEC);
+    writer->stopFd = eventfd(0, EFD_CLOEXEC);
+    pthread_mutex_init(&writer->doneLock, NULL);
+    pthread_cond_init(&writer->doneWake, NULL);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (writer->epfd == -1 || writer->stopFd == -1 ||
+        epoll_ctl(writer->epfd, EPOLL_CTL_ADD, writer->stopFd, &ev) == -1 ||
+        pthread_create(&writer->publisher, NULL, publishWork, writer) != 0) {
+        perror("error: cache writer\n");
+        if (writer->epfd != -1) close(writer->epfd);
+        if (writer->stopFd != -1) close(writer->stopFd);
+        free(writer);
+        return NULL;
+    }
+    if (pthread_create(&writer->thread, NULL, writerWork, writer) != 0) {
+        perror("error: cache writer\n");
+        pthread_mutex_lock(&writer->doneLock);
+        writer->stopping = 1;
+        pthread_cond_signal(&writer->doneWake);
+        pthread_mutex_unlock(&writer->doneLock);
+        pthread_join(writer->publisher, NULL);
+        close(writer->epfd);
+        close(writer->stopFd);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+/**
+ * Stop the cache writer once its fills are finished, and free it.
+ * @param writer the cache writer
+ */
+void writerFree(CacheWriter *writer) {
+    if (writer == NULL)
+        return;
+    uint64_t one = 1;
+    if (write(writer->stopFd, &one, sizeof(one)) < 0)
+        perror("error: write eventfd\n");
+    pthread_join(writer->thread, NULL); /// It ends when the publisher finished every fill.
+    pthread_mutex_lock(&writer->doneLock);
+    writer->stopping = 1;
+    pthread_cond_signal(&writer->doneWake);
+    pthread_mutex_unlock(&writer->doneLock);
+    pthread_join(writer->publisher, NULL);
+    pthread_mutex_destroy(&writer->doneLock);
+    pthread_cond_destroy(&writer->doneWake);
+    close(writer->epfd);
+    close(writer->stopFd);
+    arenaFree(&writer->arena);
+    free(writer);
+}
+
+/**
+ * Start the fill of a response into the cache store: a temporary file, and a pipe the relay
+ * writes into and the writer thread drains into the file.
+ * @param writer the cache writer
+ * @param url URL struct
+ * @param meta the metadata of the response
+ * @param flight the requests waiting for this fetch, NULL - none
+ * @param arena the arena of the request
+ * @param fill set to the fill, the writer owns it
+ * @return the write end of the pipe for the relay, -1 if the response can't be stored
+ */
+int fillStart(CacheWriter *writer, URL *url, const CacheMeta *meta, Flight *flight, Arena *arena, Fill **fill) {
+    int fds[2];
+    char *temp = hiddenPath(arena, url->fullPath, ".XXXXXX");
+    Fill *newFill = (Fill *) calloc(1, sizeof(Fill));
+    if (temp == NULL || newFill == NULL || storeDirectory(writer->store, url->keyHash) == -1) {
+        free(newFill);
+        return -1;
+    }
+    if ((newFill->fileFd = mkstemp(temp)) < 0) {
+        free(newFill);
+        return -1;
+    }
+    fchmod(newFill->fileFd, 0644);
+    newFill->tempPath = strdup(temp);
+    newFill->fullPath = strdup(url->fullPath);
+    newFill->key = strdup(url->key);
+    if (newFill->tempPath == NULL || newFill->fullPath == NULL || newFill->key == NULL ||
+        pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        close(newFill->fileFd);
+        unlink(temp);
+        free(newFill->tempPath);
+        free(newFill->fullPath);
+        free(newFill->key);
+        free(newFill);
+        return -1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, WRITER_PIPE_SIZE); /// The default size is kept if it is over the limit.
+    newFill->pipeFd = fds[0];
+    newFill->hash = url->keyHash;
+    newFill->meta = *meta;
+    if (flight != NULL) {
+        pthread_mutex_lock(&flight->table->lock);
+        flight->refs++;
+        pthread_mutex_unlock(&flight->table->lock);
+        newFill->flight = flight;
+    }
+    __atomic_add_fetch(&writer->active, 1, __ATOMIC_SEQ_CST);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = newFill};
+    if (epoll_ctl(writer->epfd, EPOLL_CTL_ADD, fds[0], &ev) == -1) {
+        close(fds[1]);
+        fillDrained(writer, newFill, 1);
+        return -1;
+    }
+    *fill = newFill;
+    return fds[1];
+}
+
+/**
+ * End the part of the relay in a fill, the writer finishes it when it drained the pipe.
+ * @param fill the fill
+ * @param fd the write end of its pipe
+ * @param dropped 1 - the body in the pipe is not whole
+ */
+void fillEnd(Fill *fill, int fd, int dropped) {
+    if (dropped)
+        __atomic_store_n(&fill->dropped, 1, __ATOMIC_RELEASE);
+    close(fd);
+}
+
+/**
+ * Check if the client wants to keep the connection after the response.
+ * @param parser the parser of the request
+ * @param req the request buffer
+ * @return 1 - keep-alive, 0 - close
+ */
+int wantKeepAlive(const RequestParser *parser, const char *req) {
+    size_t len;
+    if (parser->state != REQ_DONE)
+        return 0;
+    int http11 = (parser->version.len == 8 && strncmp(req + parser->version.off, "HTTP/1.1", 8) == 0);
+    const char *conn = requestHeader(parser, req, "connection", &len);
+    if (conn == NULL)
+        return http11;
+    if (len >= 5 && strncasecmp(conn, "close", 5) == 0)
+        return 0;
+    return http11 || (len >= 10 && strncasecmp(conn, "keep-alive", 10) == 0);
+}
+
+/**
+ * Check if the server took all the requests it should serve.
+ * @param ctx the server context
+ * @return 1 - no more accepts, 0 - otherwise
+ */
+int acceptDone(serverCtx *ctx) {
+    return ctx->maxReq > 0 && __atomic_load_n(&ctx->countReq, __ATOMIC_SEQ_CST) >= ctx->maxReq;
+}
+
+/**
+ * Count a request that the pool takes, a kept-alive connection counts each of its requests.
+ * @param args the connection
+ * @return 0 - serve it, -1 - the server took all the requests it serves
+ */
+int requestTake(argThread *args) {
+    serverCtx *ctx = args->ctx;
+    if (ctx->maxReq == 0)
+        return 0;
+    if (__atomic_fetch_add(&ctx->countReq, 1, __ATOMIC_SEQ_CST) >= ctx->maxReq)
+        return -1;
+    args->counted = 1;
+    return 0;
+}
+
+/**
+ * Count a finished request, the last one stops the event loops.
+ * @param args the connection
+ */
+void requestDone(argThread *args) {
+    serverCtx *ctx = args->ctx;
+    if (!args->counted)
+        return;
+    args->counted = 0;
+    if (__atomic_add_fetch(&ctx->doneReq, 1, __ATOMIC_SEQ_CST) == ctx->maxReq) {
+        uint64_t one = 1;
+        if (write(ctx->stopFd, &one, sizeof(one)) < 0)
+            perror("error: write eventfd\n");
+    }
+}
+
+/**
+ * Take a free connection context.
+ * @param ctx the server context
+ * @return the context, NULL if all of them are in use
+ */
+argThread *takeSlot(serverCtx *ctx) {
+    argThread *args = NULL;
+    pthread_mutex_lock(&ctx->slotLock);
+    if (ctx->freeCount > 0)
+        args = &ctx->slots[ctx->freeSlots[--ctx->freeCount]];
+    pthread_mutex_unlock(&ctx->slotLock);
+    return args;
+}
+
+/**
+ * Return the context of a finished connection and count its request, its arena is reset in one shot.
+ * @param args the connection
+ */
+void releaseConnection(argThread *args) {
+    serverCtx *ctx = args->ctx;
+    arenaReset(&args->arena);
+    args->req = NULL;
+    pthread_mutex_lock(&ctx->slotLock);
+    ctx->freeSlots[ctx->freeCount++] = (int) (args - ctx->slots);
+    pthread_mutex_unlock(&ctx->slotLock);
+    requestDone(args);
+}
+
+/**
+ * Close a connection without a response.
+ * @param args the connection
+ */
+void dropConnection(argThread *args) {
+    close(args->sd);
+    releaseConnection(args);
+}
+
+/**
+ * Read what the client has sent so far without blocking.
+ * @param args the connection
+ * @return 1 - the headers are complete or the client is done sending, 0 - wait for more, -1 - failed
+ */
+int readRequest(argThread *args) {
+    ssize_t nBytes;
+    while (1) {
+        char *req = (char *) arenaRealloc(&args->arena, args->req, args->totalLenReq + 1,
+                                          args->totalLenReq + REQUEST_READ_LEN + 1);
+        if (req == NULL)
+            return -1;
+        args->req = req;
+        nBytes = read(args->sd, args->req + args->totalLenReq, REQUEST_READ_LEN);
+        if (nBytes < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        args->req[args->totalLenReq + nBytes] = '\0';
+        if (nBytes == 0) /// The client is done, a kept-alive connection without a request just closes.
+            return (args->totalLenReq == 0) ? -1 : 1;
+        args->totalLenReq += nBytes;
+        if (requestParse(&args->parser, args->req, args->totalLenReq) == 1)
+            return 1;
+    }
+}
+
+/**
+ * Add a connection at the end of the idle list of the loop.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void idleAdd(eventLoop *loop, argThread *args) {
+    args->lastActive = time(NULL);
+    args->idleNext = NULL;
+    args->idlePrev = loop->idleTail;
+    if (loop->idleTail != NULL) loop->idleTail->idleNext = args;
+    else loop->idleHead = args;
+    loop->idleTail = args;
+}
+
+/**
+ * Take a connection out of the idle list of the loop.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void idleRemove(eventLoop *loop, argThread *args) {
+    if (args->idlePrev != NULL) args->idlePrev->idleNext = args->idleNext;
+    else loop->idleHead = args->idleNext;
+    if (args->idleNext != NULL) args->idleNext->idlePrev = args->idlePrev;
+    else loop->idleTail = args->idlePrev;
+    args->idlePrev = NULL;
+    args->idleNext = NULL;
+}
+
+/**
+ * Clear the response of a connection, no file or socket is held.
+ * @param r the response
+ */
+void relayReset(Relay *r) {
+    memset(r, 0, sizeof(Relay));
+    r->fileFd = -1;
+    r->staleFd = -1;
+    r->upSd = -1;
+    r->fillFd = -1;
+    r->out = -1;
+}
+
+/**
+ * Get the buffer of the connection for bodies that go through user space.
+ * @param args the connection
+ * @return the buffer of RELAY_BUF_LEN bytes, NULL if malloc failed
+ */
+char *relayBuffer(argThread *args) {
+    if (args->buf == NULL)
+        args->buf = (char *) malloc(RELAY_BUF_LEN);
+    return args->buf;
+}
+
+/**
+ * Get the pipe of the connection that bodies are spliced through, it is kept between responses.
+ * @param args the connection
+ * @return 0 - success, -1 - no pipe (the body is copied)
+ */
+int relayPipe(argThread *args) {
+    if (args->pipe[0] == -1 && pipe2(args->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        args->pipe[0] = args->pipe[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Let go of the server connection of a response.
+ * @param args the connection
+ * @param reusable 1 - the response was read whole, the connection may go back to the idle pool
+ */
+void upstreamDone(argThread *args, int reusable) {
+    Relay *r = &args->relay;
+    if (r->upSd < 0)
+        return;
+    if (r->upWatched) /// Before the pool, another loop may take it.
+        epoll_ctl(args->loop->epfd, EPOLL_CTL_DEL, r->upSd, NULL);
+    r->upWatched = 0;
+    if (reusable && r->reuse)
+        upstreamPut(args->ctx->upstream, r->url->authority, r->upSd);
+    else
+        close(r->upSd);
+    r->upSd = -1;
+}
+
+/**
+ * Free what the response of a request holds and clear it for the next one.
+ * The pipelined bytes (r->rest) are taken out by the caller first.
+ * @param args the connection
+ * @param suc 0 - the response was sent whole
+ */
+void relayEnd(argThread *args, int suc) {
+    Relay *r = &args->relay;
+    if (r->obj != NULL)
+        hotRelease(args->ctx->hot, r->obj);
+    if (r->fileFd >= 0)
+        close(r->fileFd);
+    if (r->staleFd >= 0)
+        close(r->staleFd);
+    if (r->fill != NULL) { /// A cut file must not be served as the whole response.
+        if (suc == 0 && r->out < 0 && r->stale != NULL) /// The new response can't be stored, the old one is not good anymore.
+            __atomic_store_n(&r->fill->replaces, 1, __ATOMIC_RELEASE);
+        fillEnd(r->fill, r->fillFd, suc != 0 || r->out < 0);
+    }
+    if (r->flight != NULL) {
+        if (suc != 0) /// Otherwise it ended already, or the cache writer ends it.
+            flightFinish(r->flight, FLIGHT_FAILED);
+        flightLeave(r->flight);
+    }
+    if (r->follow != NULL)
+        flightLeave(r->follow);
+    upstreamDone(args, suc == 0);
+    if (r->pipeBytes > 0) { /// What is left in the pipe belongs to this response.
+        close(args->pipe[0]);
+        close(args->pipe[1]);
+        args->pipe[0] = args->pipe[1] = -1;
+    }
+    relayReset(r);
+}
+
+/**
+ * Fail a request that no loop watches: send an error page and free the connection.
+ * @param args the connection
+ * @param errNum the status of the error page
+ * @return -1
+ */
+int connectionFail(argThread *args, int errNum) {
+    free(args->relay.rest);
+    args->relay.rest = NULL;
+    relayEnd(args, -1);
+    sendError(errNum, args->sd);
+    releaseConnection(args);
+    return -1;
+}
+
+/**
+ * Plan to send an object from memory, the header, Connection line and body go in one sendmsg.
+ * @param args the connection
+ * @param obj the object, its reference goes to the response
+ */
+void planMemory(argThread *args, HotObject *obj) {
+    Relay *r = &args->relay;
+    const char *conn = connectionLine(r->keepAlive);
+    r->obj = obj;
+    r->iov[0].iov_base = obj->data;
+    r->iov[0].iov_len = obj->headerLen;
+    r->iov[1].iov_base = (void *) conn;
+    r->iov[1].iov_len = strlen(conn);
+    r->iov[2].iov_base = obj->data + obj->headerLen;
+    r->iov[2].iov_len = obj->len - obj->headerLen;
+    r->iovCount = 3;
+    r->source = "local filesystem";
+    args->phase = CONN_SENDING;
+}
+
+/**
+ * Plan to send a cached file, on a pool thread.
+ * Small files are kept in the in-memory cache, so the next hit does not touch the disk,
+ * the others are sent by sendfile without copying them through user space.
+ * @param args the connection
+ * @param fd the file, its descriptor goes to the response
+ * @param freshUntil when the file gets stale, 0 - never
+ * @param type the stored Content-Type, NULL or "" - guessed from the path
+ * @return 0 - success, -1 - failed (fd is closed)
+ */
+int planFile(argThread *args, int fd, time_t freshUntil, const char *type) {
+    Relay *r = &args->relay;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        perror("error: fstat.\n");
+        close(fd);
+        return -1;
+    }
+    size_t fileLen = st.st_size;
+    if (fileLen <= HOT_OBJECT_MAX) {
+        HotObject *obj = hotLoad(args->ctx->hot, r->url, fd, fileLen, freshUntil, type);
+        if (obj != NULL) {
+            close(fd);
+            planMemory(args, obj);
+            return 0;
+        }
+    }
+    char *response = (char *) arenaAlloc(&args->arena, LEN);
+    if (response == NULL) {
+        close(fd);
+        return -1;
+    }
+    size_t headerLen = buildHeader(response, fileLen, r->url->path, type);
+    strcpy(response + headerLen, connectionLine(r->keepAlive));
+    r->iov[0].iov_base = response;
+    r->iov[0].iov_len = headerLen + strlen(response + headerLen);
+    r->iovCount = 1;
+    r->fileFd = fd;
+    r->fileLen = (off_t) fileLen;
+    r->source = "local filesystem";
+    args->phase = CONN_SENDING;
+    return 0;
+}
+
+/**
+ * Plan to fetch the file from the server, a stale file is revalidated.
+ * @param args the connection
+ * @return 0 - success, -1 - failed
+ */
+int planOrigin(argThread *args) {
+    Relay *r = &args->relay;
+    if (r->stale != NULL && (r->req = conditionalRequest(&args->arena, r->req, r->stale)) == NULL)
+        return -1;
+    r->source = "origin server";
+    args->phase = CONN_CONNECTING;
+    return 0;
+}
+
+/**
+ * Follow the fetch of another request, on a pool thread.
+ * No thread waits for the head of the response: the connection is parked in the flight,
+ * which hands it back to its loop when it moves. Once the body is streamed the temporary
+ * file is sent as it grows, once the file is in the cache it is sent from there. If that
+ * fetch fails or its response is not cached, the request fetches alone.
+ * @param arg the connection (argThread)
+ * @return 0 - success, -1 - failed
+ */
+int followWork(void *arg) {
+    argThread *args = (argThread *) arg;
+    Relay *r = &args->relay;
+    Flight *flight = r->follow;
+    int fd = -1;
+    char type[META_VALUE_LEN];
+    pthread_mutex_lock(&flight->table->lock);
+    int state = flight->state;
+    if (state == FLIGHT_PENDING) {
+        args->phase = CONN_FOLLOWING;
+        args->waitNext = flight->waiters;
+        flight->waiters = args;
+        pthread_mutex_unlock(&flight->table->lock);
+        return 0;
+    }
+    if (state == FLIGHT_STREAMING && (fd = open(flight->tempPath, O_RDONLY)) < 0)
+        state = FLIGHT_FAILED;
+    ssize_t length = flight->length;
+    strcpy(type, flight->contentType);
+    pthread_mutex_unlock(&flight->table->lock);
+    if (state == FLIGHT_STREAMING) { /// The head is sent with the first bytes of the file.
+        char *response = (char *) arenaAlloc(&args->arena, LEN);
+        if (response == NULL) {
+            close(fd);
+            return connectionFail(args, 500);
+        }
+        size_t headerLen = buildHeader(response, (size_t) length, r->url->path, type);
+        strcpy(response + headerLen, connectionLine(r->keepAlive));
+        r->iov[0].iov_base = response;
+        r->iov[0].iov_len = headerLen + strlen(response + headerLen);
+        r->iovCount = 1;
+        r->fileFd = fd;
+        r->fileLen = (off_t) length;
+        r->source = "a fetch in progress";
+        args->phase = CONN_FOLLOWING;
+        handBack(args);
+        return 0;
+    }
+    flightLeave(flight);
+    r->follow = NULL;
+    if (state == FLIGHT_DONE && (fd = open(r->url->fullPath, O_RDONLY)) >= 0) {
+        CacheMeta meta;
+        time_t freshUntil = time(NULL); /// Without metadata it is used once.
+        meta.contentType[0] = '\0';
+        if (urlMeta(&args->arena, r->url, &meta) == 0)
+            freshUntil = metaFreshUntil(&meta);
+        if (planFile(args, fd, freshUntil, meta.contentType) == -1)
+            return connectionFail(args, 500);
+        handBack(args);
+        return 0;
+    }
+    if (planOrigin(args) == -1)
+        return connectionFail(args, 500);
+    handBack(args);
+    return 0;
+}
+
+/**
+ * Fetch a file that is missing or stale. Only one request of the same file goes to the server,
+ * the others follow it (followWork).
+ * @param args the connection
+ * @return 0 - success, -1 - failed
+ */
+int fetchShared(argThread *args) {
+    Relay *r = &args->relay;
+    int leader = 0;
+    Flight *flight = flightJoin(args->ctx->flights, r->url->fullPath, &leader);
+    if (flight != NULL && !leader) {
+        r->follow = flight;
+        return followWork(args);
+    }
+    r->flight = flight;
+    if (planOrigin(args) == -1)
+        return connectionFail(args, 500);
+    handBack(args);
+    return 0;
+}
+
+/**
+ * The job that the pool threads get from the event loops, for one request of the connection.
+ * The request is parsed (the filter and the resolver may block) and looked up in the cache,
+ * then the connection goes back to its loop with what to send. The pipelined bytes after the
+ * request are kept for the loop, which serves them next in order.
+ * Everything the request allocates is in the arena of the connection.
+ * @param arg the connection (argThread)
+ * @return 0 - success, -1 - failed
+ */
+int prepareWork(void *arg) {
+    argThread *args = (argThread *) arg;
+    Relay *r = &args->relay;
+    serverCtx *ctx = args->ctx;
+    char *req = args->req;
+    ssize_t reqLen = (args->parser.state == REQ_DONE) ? (ssize_t) args->parser.headLen : args->totalLenReq;
+    size_t restLen = args->totalLenReq - reqLen;
+    if (requestTake(args) == -1) { /// Past max-number-of-request.
+        dropConnection(args);
+        return -1;
+    }
+    if (restLen > 0) { /// Pipelined requests, they are served next in order.
+        if ((r->rest = (char *) malloc(restLen)) == NULL)
+            return connectionFail(args, 500);
+        memcpy(r->rest, req + reqLen, restLen);
+        r->restLen = restLen;
+    }
+    req[reqLen] = '\0';
+    args->req = NULL;
+    r->keepAlive = wantKeepAlive(&args->parser, req);
+    if ((r->url = parseRequest(&req, &args->parser, args->sd, &args->arena, ctx)) == NULL) { /// It sent the error.
+        free(r->rest);
+        relayReset(r);
+        releaseConnection(args);
+        return -1;
+    }
+    r->req = req;
+    sketchAdd(ctx->store, r->url->keyHash);
+    HotObject *obj = hotGet(ctx->hot, r->url->fullPath);
+    if (obj != NULL && obj->freshUntil != 0 && obj->freshUntil <= time(NULL)) { /// Stale, check the disk.
+        hotRelease(ctx->hot, obj);
+        obj = NULL;
+    }
+    if (obj != NULL) { /// The file is in the in-memory cache.
+        storeLookup(ctx->store, r->url); /// A hit keeps the file at the front of the LRU of the store.
+        planMemory(args, obj);
+        handBack(args);
+        return 0;
+    }
+    CacheMeta meta;
+    int fd = storeOpen(ctx->store, &args->arena, r->url, &meta);
+    if (fd >= 0) { /// The file is in the cache store.
+        time_t freshUntil = metaFreshUntil(&meta);
+        if (freshUntil > time(NULL)) {
+            if (planFile(args, fd, freshUntil, meta.contentType) == -1)
+                return connectionFail(args, 500);
+            handBack(args);
+            return 0;
+        }
+        r->stale = (CacheMeta *) arenaAlloc(&args->arena, sizeof(CacheMeta)); /// Stale, ask the server if it changed.
+        if (r->stale == NULL) {
+            close(fd);
+            return connectionFail(args, 500);
+        }
+        *r->stale = meta;
+        r->staleFd = fd;
+    }
+    return fetchShared(args);
+}
+
+/**
+ * The disk work after the response head arrived, on a pool thread: the metadata of a file
+ * that is still good (304) is stored and the file is sent, or the fill of the response is
+ * started (and a stored response that is not good anymore removed) before the loop relays it.
+ * @param arg the connection (argThread)
+ * @return 0 - success, -1 - failed
+ */
+int storeWork(void *arg) {
+    argThread *args = (argThread *) arg;
+    Relay *r = &args->relay;
+    serverCtx *ctx = args->ctx;
+    if (r->stale != NULL && r->res.status == 304) { /// Only the metadata is new.
+        metaUpdate(r->stale, &r->res, r->head);
+        writeMeta(&args->arena, r->url->fullPath, r->stale, r->url->key);
+        printf("File is revalidated by origin server\n");
+        upstreamDone(args, 1);
+        flightFinish(r->flight, FLIGHT_DONE);
+        int fd = r->staleFd;
+        r->staleFd = -1;
+        if (planFile(args, fd, metaFreshUntil(r->stale), r->stale->contentType) == -1)
+            return connectionFail(args, 500);
+        handBack(args);
+        return 0;
+    }
+    if (r->removeStale) /// The stored response is not good anymore.
+        removeCached(ctx->store, &args->arena, r->url);
+    if (r->cache) { /// The writer thread fills a temporary file, renamed to its place when it is whole.
+        CacheMeta meta;
+        metaInit(&meta, r->res.status);
+        metaUpdate(&meta, &r->res, r->head);
+        if ((r->fillFd = fillStart(ctx->writer, r->url, &meta, r->flight, &args->arena, &r->fill)) == -1) {
+            perror("open: failed, the response is not cached\n"); /// The client still gets it.
+            flightFinish(r->flight, FLIGHT_FAILED);
+        } else if (!r->chunked && r->bodyLen >= 0) {
+            flightStream(r->flight, r->fill->tempPath, r->bodyLen, meta.contentType);
+        }
+    }
+    args->phase = CONN_RELAY;
+    handBack(args);
+    return 0;
+}
+
+/**
+ * Register the sockets of a connection in its loop: the client, and the server it relays from.
+ * Both wait for reading and writing, edge-triggered; the phase says what an event means.
+ * @param loop the event loop
+ * @param args the connection
+ * @return 0 - success, -1 - failed
+ */
+int watchSockets(eventLoop *loop, argThread *args) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = args;
+    args->loop = loop;
+    if (!args->watched) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, args->sd, &ev) == -1) {
+            perror("error: epoll_ctl\n");
+            return -1;
+        }
+        args->watched = 1;
+    }
+    if (args->relay.upSd >= 0 && !args->relay.upWatched) {
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, args->relay.upSd, &ev) == -1) {
+            perror("error: epoll_ctl\n");
+            return -1;
+        }
+        args->relay.upWatched = 1;
+    }
+    return 0;
+}
+
+/**
+ * Take the sockets of a connection out of its loop, before a pool thread gets it.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void unwatchSockets(eventLoop *loop, argThread *args) {
+    if (args->watched)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, args->sd, NULL);
+    if (args->relay.upWatched)
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, args->relay.upSd, NULL);
+    args->watched = 0;
+    args->relay.upWatched = 0;
+}
+
+/**
+ * Free a connection whose socket was closed, once the loop handled its events.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void closeConnection(eventLoop *loop, argThread *args) {
+    args->watched = 0;
+    args->phase = CONN_CLOSED;
+    args->deferNext = loop->deferred;
+    loop->deferred = args;
+}
+
+/**
+ * Hand a connection to a pool thread for blocking work, once the loop handled its events.
+ * @param loop the event loop
+ * @param args the connection
+ * @param phase CONN_PREPARING, CONN_STORING or CONN_FOLLOWING
+ */
+void poolHop(eventLoop *loop, argThread *args, int phase) {
+    unwatchSockets(loop, args);
+    args->phase = phase;
+    args->deferNext = loop->deferred;
+    loop->deferred = args;
+}
+
+/**
+ * Send the head (and a body from memory) of the response without blocking, the sent part is
+ * dropped from the iovecs.
+ * @param args the connection
+ * @param more 1 - a file follows, MSG_MORE
+ * @return 1 - all of it was sent, 0 - the client socket is full, -1 - failed
+ */
+int sendIov(argThread *args, int more) {
+    Relay *r = &args->relay;
+    struct msghdr msg;
+    while (r->iovCount > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = r->iov;
+        msg.msg_iovlen = r->iovCount;
+        ssize_t checkWrite = sendmsg(args->sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+        if (checkWrite < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        r->headSent = 1;
+        r->sent += checkWrite;
+        int done = 0;
+        while (done < r->iovCount && (size_t) checkWrite >= r->iov[done].iov_len)
+            checkWrite -= r->iov[done++].iov_len;
+        if (done < r->iovCount) {
+            r->iov[done].iov_base = (char *) r->iov[done].iov_base + checkWrite;
+            r->iov[done].iov_len -= checkWrite;
+        }
+        memmove(r->iov, r->iov + done, (r->iovCount - done) * sizeof(struct iovec));
+        r->iovCount -= done;
     }
-    strcpy(copy, *req);
-    copy[strlen(*req)] = '\0';
-    char *get, *path, *protocol, *checkHost, *host;
-    checkHost = strcasestr(copy, "host:");
-    get = strtok(copy, " ");
-    path = strtok(NULL, " ");
-    protocol = strtok(NULL, " \r\n");
-    int checkVersion = 0;
-    if (protocol != NULL) {
-        if ((strcmp(protocol, "HTTP/1.0") != 0) && (strcmp(protocol, "HTTP/1.1") != 0)) {
-            checkVersion = 1;
-        }
-    }
-    if (get == NULL || path == NULL || protocol == NULL || checkHost == NULL || checkVersion == 1) {
-        sendError(400, clientSd, NULL, copy, NULL, NULL, url);
-        return NULL;
+    return 1;
+}
+
+/**
+ * Send what is left in the buffer of the connection without blocking.
+ * @param args the connection
+ * @return 1 - all of it was sent, 0 - the client socket is full, -1 - failed
+ */
+int sendBuffer(argThread *args) {
+    Relay *r = &args->relay;
+    while (r->bufStart < r->bufEnd) {
+        ssize_t checkWrite = send(args->sd, args->buf + r->bufStart, r->bufEnd - r->bufStart,
+                                  MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (checkWrite < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        r->bufStart += checkWrite;
+        r->sent += checkWrite;
     }
-    if (strcmp(get, "GET") != 0) {
-        sendError(501, clientSd, NULL, copy, NULL, NULL, url);
-        return NULL;
+    return 1;
+}
+
+/**
+ * Send the head and the file of the response without blocking.
+ * The header goes with MSG_MORE so it leaves in the same segment as the start of the body,
+ * the body is sent by sendfile, or through the buffer where sendfile is not supported.
+ * @param args the connection
+ * @param limit the file is sent up to here
+ * @return 1 - all of it was sent, 0 - the client socket is full, -1 - failed
+ */
+int sendPending(argThread *args, off_t limit) {
+    Relay *r = &args->relay;
+    int check = sendIov(args, r->offset < r->fileLen);
+    while (check == 1 && (r->offset < limit || r->bufStart < r->bufEnd)) {
+        if (r->bufStart < r->bufEnd) {
+            check = sendBuffer(args);
+            continue;
+        }
+        ssize_t checkSend = sendfile(args->sd, r->fileFd, &r->offset, limit - r->offset);
+        if (checkSend < 0 && errno == EINTR)
+            continue;
+        if (checkSend < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (checkSend < 0 && (errno == EINVAL || errno == ENOSYS) && relayBuffer(args) != NULL) {
+            size_t want = (limit - r->offset < RELAY_BUF_LEN) ? (size_t) (limit - r->offset) : RELAY_BUF_LEN;
+            ssize_t checkRead = pread(r->fileFd, args->buf, want, r->offset);
+            if (checkRead < 0 && errno == EINTR)
+                continue;
+            if (checkRead <= 0)
+                return -1;
+            r->offset += checkRead;
+            r->bufStart = 0;
+            r->bufEnd = checkRead;
+            continue;
+        }
+        if (checkSend <= 0) /// Failed, or the file got shorter.
+            return -1;
+        r->sent += checkSend;
     }
-    host = strstr(checkHost, " ");
-    if (host != NULL) {
-        host = strtok(checkHost, " ");
-        host = strtok(NULL, " \r\n");
-    } else {
-        host = strtok(checkHost, ":");
-        host = strtok(NULL, " \r\n");
-    }
-    struct hostent *hp;
-    if (isdigit(host[0])) {
-        struct in_addr address;
-        inet_aton(host, &address);
-        hp = gethostbyaddr(&address, sizeof(address), AF_INET);
-    } else {
-        hp = gethostbyname(host);
+    return check;
+}
+
+/**
+ * Send what the relay holds for the client: the head, then the body in the pipe or the buffer.
+ * @param args the connection
+ * @return 1 - all of it was sent, 0 - the client socket is full, -1 - failed
+ */
+int relayFlush(argThread *args) {
+    Relay *r = &args->relay;
+    int check = sendIov(args, 0);
+    while (check == 1 && r->pipeBytes > 0) {
+        ssize_t moved = splice(args->pipe[0], NULL, args->sd, NULL, r->pipeBytes,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR)
+            continue;
+        if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (moved <= 0)
+            return -1;
+        r->pipeBytes -= moved;
+        r->sent += moved;
     }
-    if (hp == NULL) {
-        sendError(404, clientSd, NULL, copy, NULL, NULL, url);
-        return NULL;
+    return (check == 1) ? sendBuffer(args) : check;
+}
+
+/**
+ * Read the request of a connection without blocking, once it is complete it moves to the pool.
+ * @param loop the event loop that owns the socket
+ * @param args the connection
+ */
+void handleClient(eventLoop *loop, argThread *args) {
+    int check = readRequest(args);
+    idleRemove(loop, args);
+    if (check == 0) {
+        idleAdd(loop, args);
+        return;
     }
-    if (unFilter == 0) {
-        int checkAddress = searchAddressInFilter(host_list, ip_list, host);
-        if (checkAddress == 1) {
-            sendError(403, clientSd, NULL, copy, NULL, NULL, url);
-            return NULL;
-        }
-        if (checkAddress == -1) {
-            sendError(500, clientSd, NULL, copy, NULL, NULL, url);
-            return NULL;
-        }
+    if (check == -1) {
+        close(args->sd);
+        closeConnection(loop, args);
+        return;
     }
-    char *page = "index.html";
-    char *savePath = (char *) malloc(strlen(path) + 1);
-    if (savePath == NULL) {
-        sendError(500, clientSd, NULL, copy, NULL, NULL, url);
-        return NULL;
+    poolHop(loop, args, CONN_PREPARING);
+}
+
+/**
+ * End the response of a request: what it holds is freed, and the connection reads its next
+ * request (a pipelined one goes to the pool at once) or it is closed.
+ * @param loop the event loop
+ * @param args the connection
+ * @param suc 0 - success, -1 - failed (an error page is sent if nothing was), -2 - failed after the
+ * head was sent (the client can only be closed)
+ */
+void responseDone(eventLoop *loop, argThread *args, int suc) {
+    Relay *r = &args->relay;
+    char *rest = r->rest;
+    size_t restLen = r->restLen;
+    if (suc == -1 && r->headSent) /// An error page would land inside the response.
+        suc = -2;
+    if (suc == 0) {
+        printf("File is given from %s\n", r->source);
+        printf("\n Total response bytes: %zu\n", r->sent);
     }
-    memset(savePath, '\0', strlen(path) + 1);
-    strcpy(savePath, path);
-    if (savePath[strlen(savePath) - 1] == '/') {
-        savePath = realloc(savePath, strlen(savePath) + strlen(page) + 1);
-        if (savePath == NULL) {
-            sendError(500, clientSd, NULL, copy, NULL, NULL, url);
-            return NULL;
+    int keepAlive = r->keepAlive;
+    r->rest = NULL;
+    relayEnd(args, suc);
+    requestDone(args);
+    if (suc != 0 || !keepAlive) {
+        free(rest);
+        if (suc == -1)
+            sendError(500, args->sd);
+        else
+            close(args->sd);
+        closeConnection(loop, args);
+        return;
+    }
+    arenaReset(&args->arena);
+    args->req = NULL;
+    args->totalLenReq = 0;
+    requestReset(&args->parser);
+    if (rest != NULL) {
+        args->req = (char *) arenaAlloc(&args->arena, restLen + 1);
+        if (args->req == NULL) {
+            free(rest);
+            close(args->sd);
+            closeConnection(loop, args);
+            return;
         }
-        memset(savePath + strlen(savePath), '\0', strlen(page) + 1);
-        strcat(savePath, page);
+        memcpy(args->req, rest, restLen);
+        args->req[restLen] = '\0';
+        args->totalLenReq = (ssize_t) restLen;
+        free(rest);
+        requestParse(&args->parser, args->req, restLen);
     }
-    char *fullPath = (char *) malloc(strlen(savePath) + strlen(host) + 1);
-    if (fullPath == NULL) {
-        sendError(500, clientSd, NULL, copy, savePath, NULL, url);
-        return NULL;
+    if (args->parser.state == REQ_DONE || args->parser.state == REQ_ERROR) {
+        poolHop(loop, args, CONN_PREPARING);
+        return;
+    }
+    args->phase = CONN_READING;
+    if (watchSockets(loop, args) == -1) {
+        close(args->sd);
+        closeConnection(loop, args);
+        return;
     }
-    memset(fullPath, '\0', strlen(savePath) + strlen(host) + 1);
-    strcat(fullPath, host);
-    strcat(fullPath, savePath);
+    idleAdd(loop, args);
+    handleClient(loop, args);
+}
 
-    char *saveHost = (char *) malloc(strlen(host) + 1);
-    if (saveHost == NULL) {
-        sendError(500, clientSd, NULL, copy, savePath, fullPath, url);
-        return NULL;
+/**
+ * Send a response from memory or a cached file as far as the client takes it.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void sendStep(eventLoop *loop, argThread *args) {
+    int check = sendPending(args, args->relay.fileLen);
+    if (check != 0)
+        responseDone(loop, args, (check == 1) ? 0 : -2);
+}
+
+/**
+ * Start the exchange with the server: an idle connection from the pool, or a new one that
+ * connects without blocking. The loop sends the request when the socket is writable.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void originStart(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    struct sockaddr_in server;
+    r->upSd = upstreamGet(args->ctx->upstream, r->url->authority);
+    r->reused = (r->upSd != -1);
+    args->phase = CONN_EXCHANGE;
+    if (r->upSd == -1) {
+        memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_addr = r->url->addr;
+        server.sin_port = htons((uint16_t) r->url->port);
+        if ((r->upSd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+            perror("error: socket\n");
+            responseDone(loop, args, -1);
+            return;
+        }
+        if (connect(r->upSd, (struct sockaddr *) &server, sizeof(server)) < 0 && errno != EINPROGRESS) {
+            perror("error: connect\n");
+            responseDone(loop, args, -1);
+            return;
+        }
+        args->phase = CONN_CONNECTING;
     }
-    memset(saveHost, '\0', strlen(host) + 1);
-    strcpy(saveHost, host);
+    r->reqSent = 0;
+    r->head = NULL;
+    r->headTotal = 0;
+    r->headCap = 0;
+    memset(&r->res, 0, sizeof(ResponseHead));
+    r->res.contentLength = -1;
+    r->res.maxAge = -1;
+    if (watchSockets(loop, args) == -1)
+        responseDone(loop, args, -1);
+}
 
-    char *tempReq = "GET  \r\nHOST: \r\nConnection: close\r\n\r\n";
-    *req = realloc(*req, strlen(tempReq) + strlen(path) + strlen(protocol) + strlen(host) + 1);
-    if (req == NULL) {
-        sendError(500, clientSd, saveHost, copy, savePath, fullPath, url);
-        return NULL;
+/**
+ * Drop a server connection that failed before the response head.
+ * A pooled connection may have been closed by the server, a new one is tried.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void originRetry(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    close(r->upSd);
+    r->upSd = -1;
+    r->upWatched = 0;
+    if (!r->reused) {
+        responseDone(loop, args, -1);
+        return;
     }
-    sprintf(*req, "GET %s %s\r\nHOST: %s\r\nConnection: close\r\n\r\n", path, protocol, host);
-    url->hostName = saveHost;
-    url->path = savePath;
-    url->fullPath = fullPath;
-    free(copy);
-    return url;
+    originStart(loop, args);
 }
 
 /**
- * Create folders.
- * @param url URL struct.
- * @return 0 - success, -1 - failed
+ * Move the body from the server to the client as far as both sockets allow.
+ * Nothing more is read from the server while the client didn't take what was read, so a slow
+ * client holds back its server instead of filling memory, until EPOLLOUT. The body is spliced
+ * through the pipe of the connection and tee'd into the pipe of the cache writer, so the client
+ * and the file both get it inside the kernel. The tee never waits: if the writer is behind by
+ * WRITER_PIPE_SIZE the fill is dropped, so a slow disk doesn't slow the client. A chunked body,
+ * whose end is found by following the chunks, goes through the buffer of the connection.
+ * @param loop the event loop
+ * @param args the connection
  */
-int createDirectory(URL *url) {
-    char *cpyPath, *token, *temp, *slash;
-    cpyPath = (char *) calloc(strlen(url->fullPath) + 1, sizeof(char));
-    if (cpyPath == NULL)
-        return -1;
-    strcpy(cpyPath, url->fullPath);
-    struct stat st = {0};
-    slash = "/";
-    int countSlash = 0, sizeMalloc = 0, j = 0;
-    for (size_t i = 0; i < strlen(cpyPath); i++) {
-        if (cpyPath[i] == '/') {
-            countSlash++;
-            sizeMalloc += j;
-            j = 0;
-        } else {
-            j++;
+void relayStep(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    while (1) {
+        int check = relayFlush(args);
+        if (check == 0)
+            return;
+        if (check == -1) {
+            responseDone(loop, args, -2);
+            return;
         }
-    }
-    temp = (char *) calloc((sizeMalloc + countSlash), sizeof(char));
-    if (temp == NULL)
-        return -1;
-    token = strtok(cpyPath, slash);
-    strcat(temp, token);
-    while (countSlash > 0) {
-        if (stat(temp, &st) == -1) {
-            if (mkdir(temp, 0700) == -1) {
-                return -1;
+        if (r->remaining == 0 || (r->chunked && r->chunks.state == CHUNK_DONE)) {
+            responseDone(loop, args, 0);
+            return;
+        }
+        if (r->out >= 0 && r->sizeOfFile > CACHE_OBJECT_MAX) /// Too big to store, only relay the rest.
+            r->out = -1;
+        size_t room = r->usePipe ? PIPE_BUF_LEN : RELAY_BUF_LEN;
+        size_t want = (r->remaining > 0 && (size_t) r->remaining < room) ? (size_t) r->remaining : room;
+        ssize_t got;
+        if (r->usePipe)
+            got = splice(r->upSd, NULL, args->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            got = read(r->upSd, args->buf, want);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (got < 0 && r->usePipe && (errno == EINVAL || errno == ENOSYS) && relayBuffer(args) != NULL) {
+            r->usePipe = 0; /// splice is not supported, the pipe is empty.
+            continue;
+        }
+        if (got <= 0) { /// The server closed: the end of a body without a length, else cut.
+            responseDone(loop, args, (got == 0 && r->remaining < 0 && !r->chunked) ? 0 : -2);
+            return;
+        }
+        if (r->usePipe) {
+            if (r->out >= 0) { /// tee only duplicates from the start of the pipe, all of it is this splice.
+                ssize_t copied;
+                while ((copied = tee(args->pipe[0], r->out, got, SPLICE_F_NONBLOCK)) < 0 && errno == EINTR);
+                if (copied != got) /// The writer fell behind.
+                    r->out = -1;
+            }
+            r->pipeBytes = got;
+        } else {
+            if (r->chunked && (got = chunkScan(&r->chunks, args->buf, got, &r->out)) == -1) {
+                responseDone(loop, args, -2);
+                return;
             }
+            if (r->out >= 0 && !r->chunked && write(r->out, args->buf, got) != got) /// The writer fell behind.
+                r->out = -1;
+            r->bufStart = 0;
+            r->bufEnd = got;
         }
-        if (countSlash == 1)
-            break;
-        token = strtok(NULL, slash);
-        strcat(temp, slash);
-        strcat(temp, token);
-        countSlash--;
+        if (r->remaining > 0)
+            r->remaining -= got;
+        r->sizeOfFile += got;
     }
-    free(temp);
-    free(cpyPath);
-    return 0;
 }
 
 /**
- * Send the file from file system to client.
- * @param fp file pointer(fopen).
- * @param url URL struct.
- * @param clientSd the client socket
- * @return 0 - success, -1 - failed
+ * Start the relay: the head and the start of the body read with it go first.
+ * @param loop the event loop
+ * @param args the connection
  */
-int fromSystem(FILE *fp, URL *url, int clientSd) {
-    size_t fileLen;
-    size_t checkRead;
-    if (fseek(fp, 0L, SEEK_END) != 0) {
-        perror("error: fseek.\n");
-        fclose(fp);
-        return -1;
+void relayStart(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    char *toFile = r->head + r->headCount;
+    ssize_t charsPrintToFile = r->headTotal - r->headCount;
+    r->out = r->fillFd;
+    if (r->chunked && (charsPrintToFile = chunkScan(&r->chunks, toFile, charsPrintToFile, &r->out)) == -1) {
+        responseDone(loop, args, -1);
+        return;
     }
-    fileLen = (int) ftell(fp);
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        perror("error: fseek.\n");
-        fclose(fp);
-        return -1;
+    if ((r->bodyLen >= 0 && charsPrintToFile > r->bodyLen) ||
+        (r->chunked && toFile + charsPrintToFile < r->head + r->headTotal)) {
+        if (r->bodyLen >= 0) /// More than the response, don't trust the connection.
+            charsPrintToFile = r->bodyLen;
+        r->reuse = 0;
     }
-    char sizeFile[20];
-    sprintf(sizeFile, "%zu", fileLen);
-    char tempRes[LEN] = {'\0'};
-    char *type = get_mime_type(url->path);
-    int ex_type = 0;
-    if (type != NULL) {
-        strcpy(tempRes, "HTTP/1.0 200 OK\r\nContent-Length: \r\nContent-type: \r\nConnection: close\r\n\r\n");
-        ex_type = (int) strlen(type);
-    } else {
-        strcpy(tempRes, "HTTP/1.0 200 OK\r\nContent-Length: \r\nConnection: close\r\n\r\n");
+    if (charsPrintToFile > 0) {
+        if (r->out >= 0 && !r->chunked && write(r->out, toFile, charsPrintToFile) != charsPrintToFile)
+            r->out = -1;
+        r->iov[1].iov_base = toFile;
+        r->iov[1].iov_len = charsPrintToFile;
+        r->iovCount = 2;
+        r->sizeOfFile += charsPrintToFile;
     }
+    r->remaining = (r->bodyLen >= 0) ? r->bodyLen - charsPrintToFile : -1;
+    r->usePipe = (!r->chunked && relayPipe(args) == 0);
+    if (!r->usePipe && relayBuffer(args) == NULL) {
+        responseDone(loop, args, -1);
+        return;
+    }
+    args->phase = CONN_RELAY;
+    relayStep(loop, args);
+}
 
-    char *response = (char *) calloc(strlen(tempRes) + ex_type + strlen(sizeFile) + 1, sizeof(char));
-    if (response == NULL) {
-        fclose(fp);
-        return -1;
+/**
+ * Decide what to do with the response once its head arrived: a 304 of a stale file and a
+ * response to store go to a pool thread for the disk work, the others are relayed at once.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void originHead(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    serverCtx *ctx = args->ctx;
+    printf("HTTP request =\n%s\nLEN = %lu\n", r->req, strlen(r->req));
+    r->reuse = 1;
+    r->bodyLen = bodyLength(&r->res, &r->reuse);
+    r->chunked = r->res.chunked;
+    if (r->bodyLen < 0 && !r->chunked) /// Ends when the server closes.
+        r->reuse = 0;
+    if (r->stale != NULL && r->res.status == 304) {
+        if (r->headTotal != r->headCount)
+            r->reuse = 0;
+        poolHop(loop, args, CONN_STORING);
+        return;
+    }
+    r->cache = (r->res.status == 200 && !r->res.contentRange && !r->res.noStore && !r->res.isPrivate &&
+                !r->res.encoded); /// A cached file is always answered as a whole 200.
+    r->removeStale = (r->stale != NULL && !r->cache && r->res.status < 500 && !r->res.contentRange);
+    if (r->cache && (r->stale == NULL || r->bodyLen > CACHE_OBJECT_MAX)) /// A stored object already earned its place.
+        r->cache = storeAdmit(ctx->store, r->url->keyHash, r->chunked ? -1 : r->bodyLen);
+    if (!r->cache) /// The waiters fetch it themselves.
+        flightFinish(r->flight, FLIGHT_FAILED);
+    if (r->bodyLen < 0 && !r->chunked)
+        r->keepAlive = 0;
+    size_t newHeadLen;
+    char *newHead = rewriteHead(r->head, r->headCount, r->keepAlive, &args->arena, &newHeadLen);
+    if (newHead == NULL) {
+        responseDone(loop, args, -1);
+        return;
     }
-    sprintf(response, "HTTP/1.0 200 OK\r\nContent-Length: %zu\r\n", fileLen);
-    if (ex_type != 0) {
-        strcat(response, "Content-type: ");
-        sprintf(response + strlen(response), "%s\r\n", type);
+    r->iov[0].iov_base = newHead;
+    r->iov[0].iov_len = newHeadLen;
+    r->iovCount = 1;
+    if (r->cache || r->removeStale) {
+        poolHop(loop, args, CONN_STORING);
+        return;
     }
-    strcat(response, "Connection: close\r\n\r\n");
+    relayStart(loop, args);
+}
 
-    if (write(clientSd, response, strlen(response)) < 0) {
-        fclose(fp);
-        return -1;
+/**
+ * Go on with the exchange with the server as far as its socket allows: finish the connect,
+ * send the request and read the response head, which is parsed as it arrives.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void exchangeStep(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    if (args->phase == CONN_CONNECTING) {
+        struct pollfd pfd = {r->upSd, POLLOUT, 0};
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (poll(&pfd, 1, 0) == 0) /// Not connected yet.
+            return;
+        if (getsockopt(r->upSd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+            errno = err;
+            perror("error: connect\n");
+            responseDone(loop, args, -1);
+            return;
+        }
+        args->phase = CONN_EXCHANGE;
     }
-    u_char printFromFile[BUF_LEN + 1];
-    memset(printFromFile, '\0', BUF_LEN + 1);
-    checkRead = fread(printFromFile, 1, BUF_LEN, fp);
-    if (ferror(fp)) {
-        fprintf(stderr, "fread: failed.\n");
-        fclose(fp);
-        return -1;
+    size_t reqLen = strlen(r->req);
+    while (r->reqSent < reqLen) {
+        ssize_t checkWrite = send(r->upSd, r->req + r->reqSent, reqLen - r->reqSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (checkWrite < 0 && errno == EINTR)
+            continue;
+        if (checkWrite < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (checkWrite < 0) {
+            originRetry(loop, args);
+            return;
+        }
+        r->reqSent += checkWrite;
     }
-    size_t temp = checkRead;
-    while (checkRead != fileLen) {
-        if (write(clientSd, printFromFile, temp) < 0) {
-            fclose(fp);
-            return -1;
+    while (1) {
+        if (r->headCap - r->headTotal < BUF_LEN) {
+            char *buf = (char *) arenaRealloc(&args->arena, r->head, r->headTotal + 1, r->headTotal + BUF_LEN + 1);
+            if (buf == NULL) {
+                responseDone(loop, args, -1);
+                return;
+            }
+            r->head = buf;
+            r->headCap = r->headTotal + BUF_LEN;
         }
-        memset(printFromFile, '\0', BUF_LEN + 1);
-        temp = fread(printFromFile, 1, BUF_LEN, fp);
-        if (ferror(fp)) {
-            fprintf(stderr, "fread: failed.\n");
-            fclose(fp);
-            return -1;
+        ssize_t checkRead = read(r->upSd, r->head + r->headTotal, r->headCap - r->headTotal);
+        if (checkRead < 0 && errno == EINTR)
+            continue;
+        if (checkRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (checkRead <= 0) {
+            if (r->headTotal == 0) /// Closed before answering.
+                originRetry(loop, args);
+            else
+                responseDone(loop, args, -1);
+            return;
+        }
+        r->headTotal += checkRead;
+        r->head[r->headTotal] = '\0';
+        if (responseParse(&r->res, r->head, r->headTotal) == 1) {
+            if (r->res.state != REQ_DONE) {
+                responseDone(loop, args, -1);
+                return;
+            }
+            r->headCount = (ssize_t) r->res.headLen;
+            originHead(loop, args);
+            return;
+        }
+    }
+}
+
+/**
+ * Send the file another request fetches as far as it is written and the client takes it.
+ * The connection is parked in the flight while the writer is behind, and parked on EPOLLOUT
+ * while the client is. A fill dropped before the head was sent leaves the request free to
+ * fetch the file itself.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void followStep(eventLoop *loop, argThread *args) {
+    Relay *r = &args->relay;
+    Flight *flight = r->follow;
+    while (1) {
+        pthread_mutex_lock(&flight->table->lock);
+        off_t avail = flight->written;
+        if (avail <= r->offset && r->offset < r->fileLen && flight->state == FLIGHT_STREAMING) {
+            args->waitNext = flight->waiters;
+            flight->waiters = args;
+            pthread_mutex_unlock(&flight->table->lock);
+            return;
+        }
+        pthread_mutex_unlock(&flight->table->lock);
+        if (avail <= r->offset && r->offset < r->fileLen) { /// The fill was dropped.
+            if (r->headSent) {
+                responseDone(loop, args, -2);
+                return;
+            }
+            close(r->fileFd);
+            r->fileFd = -1;
+            r->iovCount = 0;
+            flightLeave(flight);
+            r->follow = NULL;
+            if (planOrigin(args) == -1)
+                responseDone(loop, args, -1);
+            else
+                originStart(loop, args);
+            return;
         }
-        if (temp == 0)
+        int check = sendPending(args, (avail < r->fileLen) ? avail : r->fileLen);
+        if (check == 0) {
+            r->blocked = 1;
+            return;
+        }
+        if (check == -1) {
+            responseDone(loop, args, -2);
+            return;
+        }
+        if (r->offset >= r->fileLen) {
+            responseDone(loop, args, 0);
+            return;
+        }
+    }
+}
+
+/**
+ * Go on with a connection that a pool thread or a flight handed back.
+ * @param loop the event loop
+ * @param args the connection
+ */
+void connectionResume(eventLoop *loop, argThread *args) {
+    if (args->phase == CONN_FOLLOWING && args->relay.fileFd < 0) { /// The flight moved, a pool thread looks at it.
+        poolHop(loop, args, CONN_FOLLOWING);
+        return;
+    }
+    if (watchSockets(loop, args) == -1) {
+        responseDone(loop, args, -1);
+        return;
+    }
+    switch (args->phase) {
+        case CONN_SENDING:
+            sendStep(loop, args);
+            break;
+        case CONN_CONNECTING:
+            originStart(loop, args);
+            break;
+        case CONN_RELAY:
+            relayStart(loop, args);
+            break;
+        case CONN_FOLLOWING:
+            followStep(loop, args);
+            break;
+        default:
             break;
-        checkRead += temp;
     }
-    if (write(clientSd, printFromFile, temp) < 0) {
-        fclose(fp);
-        return -1;
+}
+
+/**
+ * Go on with the connections that the pool threads and the flights handed back.
+ * @param loop the event loop
+ */
+void drainInbox(eventLoop *loop) {
+    uint64_t count;
+    if (read(loop->wakeFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("error: read eventfd\n");
+    pthread_mutex_lock(&loop->inboxLock);
+    argThread *args = loop->inbox, *next;
+    loop->inbox = NULL;
+    pthread_mutex_unlock(&loop->inboxLock);
+    while (args != NULL) {
+        next = args->idleNext;
+        connectionResume(loop, args);
+        args = next;
     }
-    int totalLen = (int) (fileLen + strlen(sizeFile) + strlen(response));
-    printf("File is given from local filesystem\n");
-    printf("\n Total response bytes: %d\n", totalLen);
-    free(response);
-    return 0;
 }
 
 /**
- * Send the file from server to client socket and make a file.
- * @param url URL struct
- * @param req the request
- * @param clientSd the client socket
- * @return 0 - success, -1 - failed
+ * Handle readiness of a socket of a connection, the client or its server, by its phase.
+ * @param loop the event loop that owns the connection
+ * @param args the connection
  */
-int fromServer(URL *url, char *req, int clientSd) {
-    ssize_t checkRead, headCount = 0, checkReadBuf1, checkReadBuf2, sizeOfFile = 0, totalSize;
-    int status;
-    u_char buf1[BUF_LEN + 1], buf2[BUF_LEN + 1], buf12[(2 * BUF_LEN) + 1];
-    memset(buf1, '\0', BUF_LEN + 1);
-    memset(buf2, '\0', BUF_LEN + 1);
-    memset(buf12, '\0', (2 * BUF_LEN) + 1);
+void connectionEvent(eventLoop *loop, argThread *args) {
+    switch (args->phase) {
+        case CONN_READING:
+            handleClient(loop, args);
+            break;
+        case CONN_SENDING:
+            sendStep(loop, args);
+            break;
+        case CONN_CONNECTING:
+        case CONN_EXCHANGE:
+            exchangeStep(loop, args);
+            break;
+        case CONN_RELAY:
+            relayStep(loop, args);
+            break;
+        case CONN_FOLLOWING:
+            if (args->relay.blocked) { /// Otherwise it waits for the flight.
+                args->relay.blocked = 0;
+                followStep(loop, args);
+            }
+            break;
+        default: /// A pool thread has it, or it is closed.
+            break;
+    }
+}
 
-    int sd = connectToServer(url->hostName);
-    if (sd == -1)
-        return -1;
-    ssize_t sumWritten = 0, checkWrite = -1;
-    while ((sumWritten != (ssize_t) strlen(req)) && (checkWrite != 0)) {
-        if ((checkWrite = write(sd, req, strlen(req))) < 0) {
-            close(sd);
-            return -1;
+/**
+ * Hand the connections that need blocking work to the pool and free the closed ones, once the
+ * events of a round are handled: a later event of the round may be for one of them.
+ * A full pool sheds a new request with 503, but a response that already came from the server
+ * is stored on the loop itself: its server exchange and the requests that follow it go on.
+ * @param loop the event loop
+ */
+void runDeferred(eventLoop *loop) {
+    while (loop->deferred != NULL) {
+        argThread *args = loop->deferred;
+        loop->deferred = args->deferNext;
+        if (args->phase == CONN_CLOSED) {
+            releaseConnection(args);
+            continue;
         }
-        sumWritten += checkWrite;
+        dispatch_fn job = prepareWork;
+        if (args->phase == CONN_STORING)
+            job = storeWork;
+        else if (args->phase == CONN_FOLLOWING)
+            job = followWork;
+        if (dispatch_home(loop->ctx->tp, loop->index, job, (void *) args) == 0)
+            continue;
+        if (job == storeWork) /// It comes back through the inbox.
+            storeWork((void *) args);
+        else /// Shed the load right away.
+            connectionFail(args, 503);
     }
-    if ((checkReadBuf1 = read(sd, buf1, BUF_LEN)) < 0) {
-        close(sd);
+}
+
+/**
+ * Close the connections that waited more than CLIENT_IDLE_TIMEOUT for a request.
+ * @param loop the event loop
+ * @return milliseconds until the next one expires, -1 if there is none
+ */
+int expireIdle(eventLoop *loop) {
+    time_t now = time(NULL);
+    while (loop->idleHead != NULL && now - loop->idleHead->lastActive >= CLIENT_IDLE_TIMEOUT) {
+        argThread *args = loop->idleHead;
+        idleRemove(loop, args);
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, args->sd, NULL);
+        dropConnection(args);
+    }
+    if (loop->idleHead == NULL)
         return -1;
+    return (int) (CLIENT_IDLE_TIMEOUT - (now - loop->idleHead->lastActive)) * 1000;
+}
+
+/**
+ * Stop or resume accepting by the queue depth of the pool, for good once the server took all the
+ * requests it serves. A loop with a SO_REUSEPORT listener of its own only stops taking from it: the kernel still
+ * hashes new connections to that listener, and they wait in its backlog (LISTEN_BACKLOG) until
+ * the loop listens again, the other loops don't take them.
+ * @param loop the event loop
+ * @return 1 - the loop listens, 0 - it does not
+ */
+int admitClients(eventLoop *loop) {
+    serverCtx *ctx = loop->ctx;
+    int depth = threadpool_depth(ctx->tp);
+    if (acceptDone(ctx)) {
+        if (loop->listening)
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->sd, NULL);
+        loop->listening = 0;
+        return 0;
     }
-    char *stat = strstr((char *) buf1, "1.");
-    status = (int) strtol(stat + 4, NULL, 10);
+    if (loop->listening && depth >= QUEUE_HIGH_WATERMARK) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->sd, NULL);
+        loop->listening = 0;
+    } else if (!loop->listening && depth <= QUEUE_LOW_WATERMARK) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sd, &ev) == 0)
+            loop->listening = 1;
+    }
+    return loop->listening;
+}
 
-    if ((checkReadBuf2 = read(sd, buf2, BUF_LEN)) < 0) {
-        close(sd);
-        return -1;
+/**
+ * Accept all the pending clients and register them in the loop.
+ * @param loop the event loop that got the listener event
+ */
+void acceptClients(eventLoop *loop) {
+    serverCtx *ctx = loop->ctx;
+    int clientSd;
+    while (admitClients(loop) && (clientSd = accept4(loop->sd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        argThread *args = takeSlot(ctx);
+        if (args == NULL) { /// Too many open connections.
+            sendError(503, clientSd);
+            continue;
+        }
+        args->sd = clientSd;
+        args->req = NULL;
+        args->totalLenReq = 0;
+        requestReset(&args->parser);
+        args->ctx = ctx;
+        args->phase = CONN_READING;
+        args->watched = 0;
+        relayReset(&args->relay);
+        if (watchSockets(loop, args) == -1)
+            dropConnection(args);
+        else
+            idleAdd(loop, args);
     }
-    memcpy(buf12, buf1, checkReadBuf1);
-    memcpy((buf12 + checkReadBuf1), buf2, checkReadBuf2);
+    if (!loop->listening)
+        return;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        perror("error: accept\n");
+}
 
-    printf("HTTP request =\n%s\nLEN = %lu\n", req, strlen(req));
-    while (strstr((char *) buf12, "\r\n\r\n") == NULL) { /// Separation between headers and body.
-        if (write(clientSd, buf1, checkReadBuf1) < 0) {
-            close(sd);
-            return -1;
+/**
+ * The work function of an event loop thread.
+ * The listener is registered with data.ptr NULL and the stop eventfd with the server context.
+ * While accepting is paused the loop wakes up every ACCEPT_RETRY_MS to check the queue.
+ * @param p the event loop
+ */
+void *eventLoopWork(void *p) {
+    eventLoop *loop = (eventLoop *) p;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int timeout = expireIdle(loop);
+        if (!loop->listening && !acceptDone(loop->ctx) && !admitClients(loop) &&
+            (timeout == -1 || timeout > ACCEPT_RETRY_MS))
+            timeout = ACCEPT_RETRY_MS;
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: epoll_wait\n");
+            return NULL;
         }
-        headCount += checkReadBuf1;
-        strcpy((char *) buf1, (char *) buf2);
-        checkReadBuf1 = checkReadBuf2;
-        if ((checkReadBuf2 = read(sd, buf2, BUF_LEN)) < 0) {
-            close(sd);
-            return -1;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == loop->ctx)
+                return NULL;
+            if (events[i].data.ptr == NULL)
+                acceptClients(loop);
+            else if (events[i].data.ptr == loop)
+                drainInbox(loop);
+            else
+                connectionEvent(loop, (argThread *) events[i].data.ptr);
         }
-        memset(buf12, '\0', (2 * BUF_LEN) + 1);
-        memcpy(buf12, buf1, checkReadBuf1);
-        memcpy((buf12 + checkReadBuf1), buf2, checkReadBuf2);
+        runDeferred(loop);
     }
-    char *toFile = strstr((char *) buf12, "\r\n\r\n");
-    toFile += 4;
-    long printOut = toFile - (char *) buf12;
-    headCount += printOut;
-    if (write(clientSd, buf12, printOut) < 0) {
-        close(sd);
+}
+
+/**
+ * Find the CPUs the server may run on, one event loop runs on each.
+ * @param cpus filled with the CPU numbers, MAX_LOOPS at most
+ * @return number of CPUs
+ */
+int loopCpus(int *cpus) {
+    cpu_set_t set;
+    int count = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && count < MAX_LOOPS; cpu++) {
+            if (CPU_ISSET(cpu, &set))
+                cpus[count++] = cpu;
+        }
+    }
+    if (count > 0)
+        return count;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    count = (cores < 1) ? 1 : (cores > MAX_LOOPS) ? MAX_LOOPS : (int) cores;
+    for (int i = 0; i < count; i++) {
+        cpus[i] = i;
+    }
+    return count;
+}
+
+/**
+ * Open the listener of an event loop, the first loop takes the one of the server.
+ * A loop that can't open its own shares the listener of the server.
+ * @param ctx the server context
+ * @param loop the event loop
+ * @return 0 - success, -1 - failed
+ */
+int openLoopListener(serverCtx *ctx, eventLoop *loop) {
+    loop->sd = (loop->index == 0) ? ctx->sd : openServer(ctx->port);
+    if (loop->sd == -1) {
+        fprintf(stderr, "listen: loop %d shares the listener of the server\n", loop->index);
+        loop->sd = ctx->sd;
+    }
+    int flags = fcntl(loop->sd, F_GETFL, 0);
+    if (flags == -1 || fcntl(loop->sd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("error: fcntl\n");
         return -1;
     }
-    int charsPrintToFile = ((int) (checkReadBuf1 + checkReadBuf2) - ((int) printOut));
-    if (charsPrintToFile > 0) {
-        if (write(clientSd, toFile, charsPrintToFile) < 0) {
-            close(sd);
-            return -1;
-        }
-        sizeOfFile += charsPrintToFile;
+    return 0;
+}
+
+/**
+ * Create one event loop per core, each with its own listener and pinned to its core.
+ * The threads of the pool are pinned to the same cores, and a loop hands its requests to a
+ * thread of its core first.
+ * @param ctx the server context
+ * @return 0 - success, -1 - failed
+ */
+int startEventLoops(serverCtx *ctx) {
+    int cpus[MAX_LOOPS];
+    if ((ctx->stopFd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        perror("error: eventfd\n");
+        return -1;
     }
-    if (status >= 200 && status < 300) { /// Know if the requested website exists.
-        int dir = createDirectory(url);
-        if (dir == -1) {
-            close(sd);
+    ctx->numLoops = loopCpus(cpus);
+    if (threadpool_pin(ctx->tp, cpus, ctx->numLoops) == -1)
+        perror("pthread_setaffinity_np: the pool threads are not pinned\n");
+    for (int i = 0; i < ctx->numLoops; i++) {
+        eventLoop *loop = &ctx->loops[i];
+        struct epoll_event ev;
+        loop->ctx = ctx;
+        loop->index = i;
+        loop->cpu = cpus[i];
+        if (openLoopListener(ctx, loop) == -1)
             return -1;
-        }
-        int fpp = open(url->fullPath, O_CREAT | O_WRONLY, 0644);
-        if (fpp < 0) {
-            perror("open: failed\n");
-            close(sd);
+        if ((loop->epfd = epoll_create1(0)) < 0) {
+            perror("error: epoll_create1\n");
             return -1;
         }
-        if (charsPrintToFile > 0) {
-            if (write(fpp, toFile, charsPrintToFile) < 0) {
-                close(sd);
-                close(fpp);
-                return -1;
-            }
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->sd, &ev) == -1) {
+            perror("error: epoll_ctl\n");
+            return -1;
         }
-        memset(buf12, '\0', (2 * BUF_LEN) + 1);
-        if ((checkRead = read(sd, buf12, (2 * BUF_LEN))) < 0) {
-            close(sd);
-            close(fpp);
+        loop->listening = 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = ctx;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, ctx->stopFd, &ev) == -1) {
+            perror("error: epoll_ctl\n");
             return -1;
         }
-        while (checkRead != 0) {
-            sizeOfFile += checkRead;
-            if (write(fpp, buf12, checkRead) < 0) { /// Write tp file.
-                close(sd);
-                close(fpp);
-                return -1;
-            }
-            if (write(clientSd, buf12, checkRead) < 0) { /// Write to screen.
-                close(sd);
-                close(fpp);
-                return -1;
-            }
-            memset(buf12, '\0', (2 * BUF_LEN) + 1);
-            if ((checkRead = read(sd, buf12, (2 * BUF_LEN))) < 0) {
-                close(sd);
-                close(fpp);
-                return -1;
-            }
+        if ((loop->wakeFd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            perror("error: eventfd\n");
+            return -1;
         }
-        close(fpp);
-    } else { /// If url not found.
-        if ((checkRead = read(sd, buf12, (2 * BUF_LEN))) < 0) {
-            close(sd);
+        ev.data.ptr = loop;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeFd, &ev) == -1) {
+            perror("error: epoll_ctl\n");
             return -1;
         }
-        sizeOfFile += checkRead;
-        while (checkRead != 0) {
-            if (write(clientSd, buf12, checkRead) < 0) {
-                close(sd);
-                return -1;
-            }
-            memset(buf12, '\0', (2 * BUF_LEN) + 1);
-            if ((checkRead = read(sd, buf12, (2 * BUF_LEN))) < 0) {
-                close(sd);
-                return -1;
-            }
-            sizeOfFile += checkRead;
+        pthread_mutex_init(&loop->inboxLock, NULL);
+        pthread_attr_t attr;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        pthread_attr_init(&attr);
+        if (pthread_attr_setaffinity_np(&attr, sizeof(set), &set) != 0)
+            loop->cpu = -1;
+        int check = pthread_create(&loop->thread, &attr, eventLoopWork, loop);
+        pthread_attr_destroy(&attr);
+        if (check != 0) {
+            perror("pthread_create: creat event loop failed.\n");
+            return -1;
         }
     }
-    totalSize = (sizeOfFile + headCount);
-    printf("File is given from origin server\n");
-    printf("\n Total response bytes: %zu\n", totalSize);
-    close(sd);
     return 0;
 }
 
 /**
- * The main function that the thread do.
- * @param arg struct with data
- * @return 0 - success, -1 - failed
+ * Build the filter again and swap it in, the old one stays if the file can't be read.
+ * @param ctx the server
  */
-int threadWork(void *arg) {
-    argThread *args = ((argThread *) arg);
-    char *req = (char *) malloc(LEN + 1);
-    if (req == NULL) {
-        sendError(500, args->sd, NULL, NULL, NULL, NULL, NULL);
-        return -1;
+void reloadFilter(serverCtx *ctx) {
+    Filter *filter = loadFilter(ctx->filterPath, ctx->filter->generation + 1);
+    if (filter == NULL) {
+        fprintf(stderr, "filter: reload failed, keeping the old filter\n");
+        return;
     }
-    memset(req, '\0', LEN + 1);
-    ssize_t nBytes, totalLenReq = 0;
-    while ((nBytes = read(args->sd, req + totalLenReq, LEN)) > 0) {
-        if (nBytes < 0) {
-            sendError(500, args->sd, NULL, NULL, NULL, NULL, NULL);
-            return -1;
+    filterSwap(ctx, filter);
+    printf("filter: reloaded (generation %lu)\n", filter->generation);
+}
+
+/**
+ * The reload thread, it rebuilds the filter on SIGHUP or when the filter file changes.
+ * The directory is watched, editors often replace the file by a rename.
+ * @param arg the server
+ * @return NULL
+ */
+void *filterWatch(void *arg) {
+    serverCtx *ctx = (serverCtx *) arg;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    char *dirCopy = strdup(ctx->filterPath), *nameCopy = strdup(ctx->filterPath);
+    int sigFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    int inFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dirCopy == NULL || nameCopy == NULL || sigFd < 0 || inFd < 0 ||
+        inotify_add_watch(inFd, dirname(dirCopy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        perror("error: filter watch\n");
+    const char *name = (nameCopy != NULL) ? basename(nameCopy) : "";
+    struct pollfd fds[3] = {{ctx->stopFd, POLLIN, 0}, {sigFd, POLLIN, 0}, {inFd, POLLIN, 0}};
+    while (1) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("error: poll\n");
+            break;
         }
-        if (strstr(req, "\r\n\r\n") != NULL)
+        if (fds[0].revents != 0)
             break;
-        totalLenReq += nBytes;
-        req = (char *) realloc(req, totalLenReq + LEN);
-        if (req == NULL) {
-            sendError(500, args->sd, NULL, NULL, NULL, NULL, NULL);
-            return -1;
+        int changed = 0;
+        if (fds[1].revents != 0) {
+            struct signalfd_siginfo info;
+            while (read(sigFd, &info, sizeof(info)) == sizeof(info))
+                changed = 1;
         }
-        memset(req + totalLenReq, '\0', LEN);
-    }
-    URL *url;
-    url = parseRequest(&req, args->sd, args->unFilter, args->host_list, args->ip_list);
-    if (url == NULL) {
-        free(req);
-        return -1;
-    }
-    FILE *fp = fopen(url->fullPath, "r");
-    int suc = 0;
-    if (fp != NULL) { /// The file appears in the local filesystem.
-        suc = fromSystem(fp, url, args->sd);
-        fclose(fp);
-    } else {
-        suc = fromServer(url, req, args->sd);
-    }
-    if (suc == -1) {
-        sendError(500, args->sd, req, url->hostName, url->path, url->fullPath, url);
-        return -1;
+        if (fds[2].revents != 0) {
+            char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len;
+            while ((len = read(inFd, buf, sizeof(buf))) > 0) {
+                struct inotify_event *event;
+                for (char *p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len) {
+                    event = (struct inotify_event *) p;
+                    if (event->len > 0 && strcmp(event->name, name) == 0)
+                        changed = 1;
+                }
+            }
+        }
+        if (changed)
+            reloadFilter(ctx);
     }
-    free(req);
-    free(url->hostName);
-    free(url->path);
-    free(url->fullPath);
-    free(url);
-    close(args->sd);
-    return 0;
+    if (sigFd >= 0) close(sigFd);
+    if (inFd >= 0) close(inFd);
+    free(dirCopy);
+    free(nameCopy);
+    return NULL;
 }
 
 /**
- * Opening a server, creating threads to execute requests.
+ * Opening a server, the event loops accept and read the requests, the threads execute them.
+ * The filter is rebuilt by a reload thread while the server runs.
  * @param port the port that server listen to
  * @param poolSize the size of the threadpool
- * @param maxReq Top block for the number of requests
- * @param host_list Host Link list
- * @param ip_list IP Link list
- * @param unFilter to know if we have filter, 0 - have, 1 - there is no
- */
-void server(int port, int poolSize, int maxReq, LinkList_Host *host_list, LinkList_IP *ip_list, int unFilter) {
-    int countReq = 0, clientSd;
-    threadpool *tp = create_threadpool(poolSize);
+ * @param maxReq Top block for the number of requests, 0 - unlimited
+ * @param filter the filter loaded from filterPath
+ * @param filterPath the filter file
+ */
+void server(int port, int poolSize, int maxReq, Filter *filter, const char *filterPath) {
+    threadpool *tp = create_threadpool_sched(poolSize, POOL_SCHED_DEFAULT, QUEUE_LIMIT);
     if (tp == NULL) {
-        free_LinkList(host_list, ip_list);
+        freeFilter(filter);
         exit(EXIT_FAILURE);
     }
     int sd = openServer(port);
     if (sd == -1) {
-        free_LinkList(host_list, ip_list);
+        freeFilter(filter);
         exit(EXIT_FAILURE);
     }
-    argThread **args = (argThread **) calloc(maxReq, sizeof(argThread *));
-    if (args == NULL) {
+    serverCtx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.slots = (argThread *) calloc(MAX_CONNECTIONS, sizeof(argThread));
+    ctx.freeSlots = (int *) malloc(MAX_CONNECTIONS * sizeof(int));
+    if (ctx.slots == NULL || ctx.freeSlots == NULL || pthread_mutex_init(&ctx.slotLock, NULL) != 0) {
         close(sd);
-        free_LinkList(host_list, ip_list);
+        freeFilter(filter);
         exit(EXIT_FAILURE);
     }
-    while (countReq < maxReq) {
-        if ((clientSd = accept(sd, NULL, NULL)) < 0) {
-            perror("error: accept\n");
-            free_LinkList(host_list, ip_list);
-            exit(EXIT_FAILURE);
-        }
-        args[countReq] = (argThread *) calloc(1, sizeof(argThread));
-        if (args[countReq] == NULL) {
-            sendError(500, clientSd, NULL, NULL, NULL, NULL, NULL);
-        } else {
-            args[countReq]->sd = clientSd;
-            args[countReq]->unFilter = unFilter;
-            args[countReq]->host_list = host_list;
-            args[countReq]->ip_list = ip_list;
-            dispatch(tp, threadWork, (void *) (args[countReq]));
-        }
-        countReq++;
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        ctx.freeSlots[i] = MAX_CONNECTIONS - 1 - i;
+        ctx.slots[i].pipe[0] = ctx.slots[i].pipe[1] = -1;
+    }
+    ctx.freeCount = MAX_CONNECTIONS;
+    ctx.sd = sd;
+    ctx.port = port;
+    ctx.maxReq = maxReq;
+    ctx.tp = tp;
+    ctx.hot = hotCreate();
+    ctx.upstream = upstreamCreate();
+    ctx.store = storeCreate();
+    ctx.writer = (ctx.store == NULL) ? NULL : writerCreate(ctx.store);
+    ctx.flights = flightCreate();
+    ctx.dns = dnsCreate();
+    ctx.decisions = decisionCreate();
+    if (ctx.hot == NULL || ctx.upstream == NULL || ctx.store == NULL || ctx.writer == NULL || ctx.flights == NULL || ctx.dns == NULL || ctx.decisions == NULL) {
+        close(sd);
+        freeFilter(filter);
+        exit(EXIT_FAILURE);
+    }
+    ctx.filter = filter;
+    ctx.filterPath = filterPath;
+    if (startEventLoops(&ctx) == -1) {
+        close(sd);
+        freeFilter(filter);
+        exit(EXIT_FAILURE);
     }
+    if (pthread_create(&ctx.reloadThread, NULL, filterWatch, &ctx) == 0)
+        ctx.reloading = 1;
+    else
+        perror("pthread_create: filter reload disabled.\n");
+    for (int i = 0; i < ctx.numLoops; i++) {
+        pthread_join(ctx.loops[i].thread, NULL);
+        if (ctx.loops[i].sd != sd)
+            close(ctx.loops[i].sd);
+        close(ctx.loops[i].epfd);
+        close(ctx.loops[i].wakeFd);
+        pthread_mutex_destroy(&ctx.loops[i].inboxLock);
+    }
+    if (ctx.reloading)
+        pthread_join(ctx.reloadThread, NULL);
     destroy_threadpool(tp);
-    for (int i = 0; i < maxReq; i++) {
-        if (args[i] != NULL)
-            free(args[i]);
+    hotFree(ctx.hot);
+    upstreamFree(ctx.upstream);
+    writerFree(ctx.writer);
+    storeFree(ctx.store);
+    flightFree(ctx.flights);
+    dnsFree(ctx.dns);
+    decisionFree(ctx.decisions);
+    freeFilter(ctx.filter);
+    pthread_mutex_destroy(&ctx.slotLock);
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        arenaFree(&ctx.slots[i].arena);
+        free(ctx.slots[i].buf);
+        if (ctx.slots[i].pipe[0] != -1) {
+            close(ctx.slots[i].pipe[0]);
+            close(ctx.slots[i].pipe[1]);
+        }
     }
-    free(args);
+    free(ctx.slots);
+    free(ctx.freeSlots);
+    close(ctx.stopFd);
     close(sd);
 }
 
@@ -1007,7 +5651,7 @@ int validUsage(int argc, char **argv) {
     val1 = (int) strtol(argv[1], NULL, 10);
     val2 = (int) strtol(argv[2], NULL, 10);
     val3 = (int) strtol(argv[3], NULL, 10);
-    if (val1 <= 0 || val2 <= 0 || val2 > MAXT_IN_POOL || val3 <= 0)
+    if (val1 <= 0 || val2 <= 0 || val2 > MAXT_IN_POOL || val3 < 0)
         return -1;
     return 0;
 }
@@ -1017,30 +5661,23 @@ int validUsage(int argc, char **argv) {
  * @param argv
  */
 int main(int argc, char *argv[]) {
-    int usage = validUsage(argc, argv), unFilter;
+    int usage = validUsage(argc, argv);
     if (usage == -1) {
-        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request> <filter>\n");
+        printf("Usage: proxyServer <port> <pool-size> <max-number-of-request(0 - unlimited)> <filter>\n");
         exit(EXIT_FAILURE);
     }
-    LinkList_Host *host = NULL;
-    LinkList_IP *ip = NULL;
-    FILE *fp = fopen(argv[4], "r");
-    if (fp == NULL) {
-        fprintf(stderr, "fopen: failed");
+    Filter *filter = loadFilter(argv[4], 0);
+    if (filter == NULL)
         exit(EXIT_FAILURE);
-    }
-    unFilter = checkFilter(fp); ///return 1 if the filter is empty or if the file not exists.
-    if (unFilter == 0) {
-        host = (LinkList_Host *) malloc(sizeof(LinkList_Host));
-        ip = (LinkList_IP *) malloc(sizeof(LinkList_IP));
-        initLists(host, ip, fp);
-        makeFilter(fp, host, ip);
-    }
     int port, poolSize, maxReq;
     port = (int) strtol(argv[1], NULL, 10);
     poolSize = (int) strtol(argv[2], NULL, 10);
     maxReq = (int) strtol(argv[3], NULL, 10);
-    server(port, poolSize, maxReq, host, ip, unFilter);
-    free_LinkList(host, ip);
+    signal(SIGPIPE, SIG_IGN); /// A client that closes early fails the write, not the process.
+    sigset_t mask; /// SIGHUP is read by the reload thread, every thread inherits the blocked mask.
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    server(port, poolSize, maxReq, filter, argv[4]);
     return 0;
 }
@@ -1,7 +1,10 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sched.h>
 #include <sys/types.h>
 #include "threadpool.h"
 
@@ -9,10 +12,50 @@
  * If the function succeeds, it returns a (non-NULL) "threadPool", else it returns NULL.
  */
 threadpool *create_threadpool(int num_threads_in_pool) {
+    return create_threadpool_sched(num_threads_in_pool, POOL_SCHED_DEFAULT, POOL_QUEUE_LIMIT);
+}
+
+/**
+ * Initialize the queue of every worker, cell i is free for the push number i.
+ * @param tPool the pool
+ * @return 0 - success, -1 - failed
+ */
+static int init_workers(threadpool *tPool) {
+    if (posix_memalign((void **) &tPool->workers, 64, tPool->num_threads * sizeof(worker_t)) != 0) {
+        tPool->workers = NULL;
+        return -1;
+    }
+    for (int i = 0; i < tPool->num_threads; i++) {
+        worker_t *worker = &tPool->workers[i];
+        worker->head = 0;
+        worker->tail = 0;
+        for (unsigned long j = 0; j < WORKER_QUEUE_SIZE; j++) {
+            worker->cells[j].seq = j;
+        }
+        worker->pool = tPool;
+        worker->id = i;
+    }
+    if (sem_init(&tPool->jobs, 0, 0) != 0) {
+        free(tPool->workers);
+        tPool->workers = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/** create_threadpool_sched creates a fixed-sized threadPool with the given scheduler,
+ * at most qlimit jobs may wait in it.
+ * If the function succeeds, it returns a (non-NULL) "threadPool", else it returns NULL.
+ */
+threadpool *create_threadpool_sched(int num_threads_in_pool, int sched, int qlimit) {
     if (num_threads_in_pool > MAXT_IN_POOL) {
         fprintf(stderr, "Illegal number of threads.\n");
         return NULL;
     }
+    if (qlimit <= 0) {
+        fprintf(stderr, "Illegal queue limit.\n");
+        return NULL;
+    }
     threadpool *tPool = (threadpool *) malloc(sizeof(threadpool));
     if (tPool == NULL) {
         fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
@@ -22,8 +65,14 @@ threadpool *create_threadpool(int num_threads_in_pool) {
     tPool->qsize = 0;
     tPool->shutdown = 0;
     tPool->dont_accept = 0;
-    tPool->qhead = NULL;
-    tPool->qtail = NULL;
+    tPool->qlimit = qlimit;
+    tPool->ring = NULL;
+    tPool->qhead = 0;
+    tPool->qtail = 0;
+    tPool->sched = sched;
+    tPool->workers = NULL;
+    tPool->next_worker = 0;
+    tPool->homes = 0;
     if (pthread_mutex_init(&tPool->qlock, NULL) != 0) {
         fprintf(stderr, "init: mutex init failed.\n");
         return NULL;
@@ -36,13 +85,29 @@ threadpool *create_threadpool(int num_threads_in_pool) {
         fprintf(stderr, "init: cond init failed.\n");
         return NULL;
     }
+    if (sched == POOL_SCHED_STEAL && init_workers(tPool) != 0) {
+        fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
+        return NULL;
+    }
+    if (sched == POOL_SCHED_QUEUE) {
+        tPool->ring = (work_cell *) calloc(qlimit, sizeof(work_cell));
+        if (tPool->ring == NULL) {
+            fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
+            return NULL;
+        }
+    }
     tPool->threads = (pthread_t *) malloc(num_threads_in_pool * sizeof(pthread_t));
     if (tPool->threads == NULL) {
         fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
         return NULL;
     }
     for (int i = 0; i < num_threads_in_pool; i++) {
-        if (pthread_create(&tPool->threads[i], NULL, do_work, tPool) != 0) {
+        int check;
+        if (sched == POOL_SCHED_STEAL)
+            check = pthread_create(&tPool->threads[i], NULL, do_steal_work, &tPool->workers[i]);
+        else
+            check = pthread_create(&tPool->threads[i], NULL, do_work, tPool);
+        if (check != 0) {
             perror("pthread_create: creat threads failed.\n");
             return NULL;
         }
@@ -51,37 +116,147 @@ threadpool *create_threadpool(int num_threads_in_pool) {
 }
 
 /**
- * dispatch enter a "job" of type work_t into the queue.
- * when an available thread takes a job from the queue, it will
- * call the function "dispatch_to_here" with argument "arg".
+ * Push a job into the queue of a worker, any thread may push.
+ * @return 0 - success, -1 - the queue is full
  */
-void dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
-    pthread_mutex_lock(&from_me->qlock);
-    if (from_me->dont_accept == 1) {
-        pthread_mutex_unlock(&from_me->qlock);
-        return;
+static int worker_push(worker_t *worker, dispatch_fn routine, void *arg) {
+    unsigned long pos = __atomic_load_n(&worker->tail, __ATOMIC_RELAXED);
+    while (1) {
+        work_cell *cell = &worker->cells[pos & (WORKER_QUEUE_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) pos;
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&worker->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->routine = routine;
+                cell->arg = arg;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&worker->tail, __ATOMIC_RELAXED);
+        }
     }
-    pthread_mutex_unlock(&from_me->qlock);
+}
 
-    work_t *work = (work_t *) malloc(sizeof(work_t));
-    if (work == NULL) {
-        fprintf(stderr, "Allocation failure: Memory allocation failed.\n");
-        exit(EXIT_FAILURE);
+/**
+ * Pop a job from the queue of a worker, used by the owner and by thieves.
+ * @return 0 - got a job, -1 - the queue is empty
+ */
+static int worker_pop(worker_t *worker, work_cell *out) {
+    unsigned long pos = __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+    while (1) {
+        work_cell *cell = &worker->cells[pos & (WORKER_QUEUE_SIZE - 1)];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) seq - (long) (pos + 1);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&worker->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                out->routine = cell->routine;
+                out->arg = cell->arg;
+                __atomic_store_n(&cell->seq, pos + WORKER_QUEUE_SIZE, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/// release a queue slot of the stealing scheduler, the last one wakes destroy_threadpool.
+static void steal_release(threadpool *tPool) {
+    if (__atomic_sub_fetch(&tPool->qsize, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&tPool->dont_accept, __ATOMIC_SEQ_CST) == 1) {
+        pthread_mutex_lock(&tPool->qlock);
+        pthread_cond_signal(&tPool->q_empty);
+        pthread_mutex_unlock(&tPool->qlock);
+    }
+}
+
+/// dispatch for the stealing scheduler, round robin over the worker queues (of the home CPU first).
+static int dispatch_steal(threadpool *from_me, int home, dispatch_fn dispatch_to_here, void *arg) {
+    /// The slot is taken before dont_accept is read: either destroy_threadpool sees it and waits,
+    /// or this sees dont_accept and gives it back.
+    if (__atomic_add_fetch(&from_me->qsize, 1, __ATOMIC_SEQ_CST) > from_me->qlimit ||
+        __atomic_load_n(&from_me->dont_accept, __ATOMIC_SEQ_CST) == 1) {
+        steal_release(from_me);
+        return -1;
+    }
+    unsigned int start = __atomic_fetch_add(&from_me->next_worker, 1, __ATOMIC_RELAXED);
+    int n = from_me->num_threads, homes = from_me->homes;
+    if (home >= 0 && home < homes && home < n) { /// Workers home, home + homes, ... run on that CPU.
+        int members = (n - home + homes - 1) / homes;
+        if (worker_push(&from_me->workers[home + (start % members) * homes], dispatch_to_here, arg) == 0) {
+            sem_post(&from_me->jobs);
+            return 0;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (worker_push(&from_me->workers[(start + i) % n], dispatch_to_here, arg) == 0) {
+            sem_post(&from_me->jobs);
+            return 0;
+        }
     }
-    work->routine = dispatch_to_here;
-    work->arg = arg;
-    work->next = NULL;
+    steal_release(from_me); /// Every queue is full.
+    return -1;
+}
+
+/**
+ * dispatch_home enter a "job" into the queue, the stealing scheduler puts it
+ * in the queue of a worker on the CPU "home" when it can.
+ * when an available thread takes a job from the queue, it will
+ * call the function "dispatch_to_here" with argument "arg".
+ * @return 0 - success, -1 - the queue is full or the pool is being destroyed
+ */
+int dispatch_home(threadpool *from_me, int home, dispatch_fn dispatch_to_here, void *arg) {
+    if (from_me->sched == POOL_SCHED_STEAL)
+        return dispatch_steal(from_me, home, dispatch_to_here, arg);
     pthread_mutex_lock(&from_me->qlock);
-    if (from_me->qhead == NULL) {
-        from_me->qhead = work;
-        from_me->qtail = work;
-    } else {
-        from_me->qtail->next = work;
-        from_me->qtail = work;
+    if (from_me->dont_accept == 1 || from_me->qsize == from_me->qlimit) {
+        pthread_mutex_unlock(&from_me->qlock);
+        return -1;
     }
+    from_me->ring[from_me->qtail].routine = dispatch_to_here;
+    from_me->ring[from_me->qtail].arg = arg;
+    from_me->qtail = (from_me->qtail + 1) % from_me->qlimit;
     from_me->qsize++;
     pthread_cond_signal(&from_me->q_not_empty);
     pthread_mutex_unlock(&from_me->qlock);
+    return 0;
+}
+
+/**
+ * dispatch enter a "job" into the queue, for any worker.
+ * @return 0 - success, -1 - the queue is full or the pool is being destroyed
+ */
+int dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg) {
+    return dispatch_home(from_me, -1, dispatch_to_here, arg);
+}
+
+/**
+ * Pin the threads of the pool to the CPUs, thread i to cpus[i % count].
+ * @return 0 - success, -1 - a thread could not be pinned
+ */
+int threadpool_pin(threadpool *tp, const int *cpus, int count) {
+    int suc = 0;
+    if (count <= 0)
+        return -1;
+    for (int i = 0; i < tp->num_threads; i++) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % count], &set);
+        if (pthread_setaffinity_np(tp->threads[i], sizeof(set), &set) != 0)
+            suc = -1;
+    }
+    tp->homes = count;
+    return suc;
+}
+
+/// The number of jobs waiting in the queue.
+int threadpool_depth(threadpool *tp) {
+    return __atomic_load_n(&tp->qsize, __ATOMIC_RELAXED);
 }
 
 /// The work function of the thread.
@@ -100,19 +275,48 @@ void *do_work(void *p) {
             pthread_mutex_unlock(&tPool->qlock);
             return NULL;
         }
-        work_t *workOut = tPool->qhead;
-        if (workOut == NULL) {
+        if (tPool->qsize == 0) {
             pthread_mutex_unlock(&tPool->qlock);
             continue;
         }
-        tPool->qhead = tPool->qhead->next;
+        work_cell workOut = tPool->ring[tPool->qhead];
+        tPool->qhead = (tPool->qhead + 1) % tPool->qlimit;
         tPool->qsize--;
         if (tPool->qsize == 0 && tPool->dont_accept == 1) {
             pthread_cond_signal(&tPool->q_empty);
         }
         pthread_mutex_unlock(&tPool->qlock);
-        workOut->routine(workOut->arg);
-        free(workOut);
+        workOut.routine(workOut.arg);
+    }
+}
+
+/**
+ * The work function of a thread of the stealing scheduler.
+ * Every unit of "jobs" stands for a job in one of the queues, the thread pops its own
+ * queue first and then steals from the others.
+ */
+void *do_steal_work(void *p) {
+    worker_t *worker = (worker_t *) p;
+    threadpool *tPool = worker->pool;
+    int n = tPool->num_threads;
+    work_cell job;
+    while (1) {
+        if (sem_wait(&tPool->jobs) != 0) {
+            if (errno == EINTR)
+                continue;
+            return NULL;
+        }
+        if (__atomic_load_n(&tPool->shutdown, __ATOMIC_SEQ_CST) == 1)
+            return NULL;
+        int found = -1;
+        while (found != 0) {
+            found = worker_pop(worker, &job);
+            for (int i = 1; i < n && found != 0; i++) {
+                found = worker_pop(&tPool->workers[(worker->id + i) % n], &job);
+            }
+        }
+        steal_release(tPool);
+        job.routine(job.arg);
     }
 }
 
@@ -122,11 +326,19 @@ void *do_work(void *p) {
  */
 void destroy_threadpool(threadpool *destroyme) {
     pthread_mutex_lock(&destroyme->qlock);
-    destroyme->dont_accept = 1;
-    if(destroyme->qsize != 0)
-        pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
-    destroyme->shutdown = 1;
-    pthread_cond_broadcast(&destroyme->q_not_empty);
+    __atomic_store_n(&destroyme->dont_accept, 1, __ATOMIC_SEQ_CST);
+    if (destroyme->sched == POOL_SCHED_STEAL) {
+        while (__atomic_load_n(&destroyme->qsize, __ATOMIC_SEQ_CST) != 0)
+            pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
+        __atomic_store_n(&destroyme->shutdown, 1, __ATOMIC_SEQ_CST);
+        for (int i = 0; i < destroyme->num_threads; i++)
+            sem_post(&destroyme->jobs);
+    } else {
+        if (destroyme->qsize != 0)
+            pthread_cond_wait(&destroyme->q_empty, &destroyme->qlock);
+        destroyme->shutdown = 1;
+        pthread_cond_broadcast(&destroyme->q_not_empty);
+    }
     pthread_mutex_unlock(&destroyme->qlock);
 
     for (int i = 0; i < destroyme->num_threads; i++) {
@@ -135,6 +347,11 @@ void destroy_threadpool(threadpool *destroyme) {
     pthread_mutex_destroy(&destroyme->qlock);
     pthread_cond_destroy(&destroyme->q_empty);
     pthread_cond_destroy(&destroyme->q_not_empty);
+    if (destroyme->sched == POOL_SCHED_STEAL) {
+        sem_destroy(&destroyme->jobs);
+        free(destroyme->workers);
+    }
+    free(destroyme->ring);
     free(destroyme->threads);
     free(destroyme);
 }
@@ -0,0 +1,135 @@
+#ifndef __THREAD_POOL__
+#define __THREAD_POOL__
+
+#include <pthread.h>
+#include <semaphore.h>
+
+// maximum number of threads allowed in a pool
+#define MAXT_IN_POOL 200
+
+// scheduler modes of the pool
+#define POOL_SCHED_QUEUE 0 // one shared queue under qlock
+#define POOL_SCHED_STEAL 1 // lock-free queue per worker, idle workers steal
+#ifndef POOL_SCHED_DEFAULT
+#define POOL_SCHED_DEFAULT POOL_SCHED_STEAL
+#endif
+
+// cells in every worker queue, must be a power of two
+#define WORKER_QUEUE_SIZE 1024
+
+// default number of jobs that may wait in the pool, dispatch rejects above it
+#ifndef POOL_QUEUE_LIMIT
+#define POOL_QUEUE_LIMIT 1024
+#endif
+
+// "dispatch_fn" declares a typed function pointer.  A
+// variable of type "dispatch_fn" points to a function
+// with the following signature:
+//
+//     int dispatch_function(void *arg);
+typedef int (*dispatch_fn)(void *);
+
+/**
+ * each job in the queues is a cell, the cells are reused so a job costs no allocation.
+ * seq tells whether a worker queue cell is free for the producer or full for the consumers,
+ * the shared ring of POOL_SCHED_QUEUE is guarded by qlock and does not use it.
+ */
+typedef struct work_cell {
+    unsigned long seq;
+    dispatch_fn routine;
+    void *arg;
+} work_cell;
+
+struct _threadpool_st;
+
+/**
+ * a worker of the stealing scheduler, its bounded queue is popped by the owner
+ * and by the idle workers that steal from it.
+ */
+typedef struct worker_st {
+    unsigned long head __attribute__((aligned(64))); //next cell to pop
+    unsigned long tail __attribute__((aligned(64))); //next cell to push
+    work_cell cells[WORKER_QUEUE_SIZE];
+    struct _threadpool_st *pool;
+    int id;
+} worker_t;
+
+/**
+ * The pool holds all necessary information regarding the pool.
+ */
+typedef struct _threadpool_st {
+    int num_threads;    //number of active threads
+    int qsize;          //number in the queue
+    int qlimit;         //max number in the queue
+    pthread_t *threads; //pointer to threads
+    work_cell *ring;    //the shared queue (POOL_SCHED_QUEUE), qlimit cells
+    int qhead;          //queue head index
+    int qtail;          //queue tail index
+    pthread_mutex_t qlock;      //lock on the queue
+    pthread_cond_t q_not_empty; //non empty and empty condidtion vairiables
+    pthread_cond_t q_empty;
+    int shutdown;            //1 if the pool is in distruction process
+    int dont_accept;       //1 if destroy function has begun
+    int sched;             //POOL_SCHED_QUEUE or POOL_SCHED_STEAL
+    worker_t *workers;     //queue per thread (POOL_SCHED_STEAL)
+    unsigned int next_worker; //round robin for dispatch
+    int homes;             //CPUs the workers are pinned to, worker i on CPU i % homes, 0 - not pinned
+    sem_t jobs;            //counts the jobs waiting in the worker queues
+} threadpool;
+
+/**
+ * create_threadpool creates a fixed-sized thread
+ * pool.  If the function succeeds, it returns a (non-NULL)
+ * "threadpool", else it returns NULL.
+ */
+threadpool *create_threadpool(int num_threads_in_pool);
+
+/**
+ * create_threadpool_sched creates a pool with the given scheduler mode
+ * and at most qlimit waiting jobs.
+ */
+threadpool *create_threadpool_sched(int num_threads_in_pool, int sched, int qlimit);
+
+/**
+ * dispatch enter a "job" into the queue.
+ * when an available thread takes a job from the queue, it will
+ * call the function "dispatch_to_here" with argument "arg".
+ * returns 0 on success, -1 if the queue is full or the pool is being destroyed.
+ */
+int dispatch(threadpool *from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_home is dispatch that first tries the queue of a worker pinned to
+ * the CPU number "home" of threadpool_pin, -1 - any worker.
+ */
+int dispatch_home(threadpool *from_me, int home, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_pin pins thread i of the pool to cpus[i % count].
+ * returns 0 on success, -1 if a thread could not be pinned.
+ */
+int threadpool_pin(threadpool *tp, const int *cpus, int count);
+
+/**
+ * threadpool_depth returns the number of jobs waiting in the queue.
+ */
+int threadpool_depth(threadpool *tp);
+
+/**
+ * The work function of the thread
+ */
+void *do_work(void *p);
+
+/**
+ * The work function of a thread of the stealing scheduler, p is its worker_t.
+ */
+void *do_steal_work(void *p);
+
+/**
+ * destroy_threadpool kills the threadpool, causing
+ * all threads in it to commit suicide, and then
+ * frees all the memory associated with the threadpool.
+ */
+void destroy_threadpool(threadpool *destroyme);
+
+#endif